@@ -22,6 +22,8 @@ extern "C" {
 }
 
 #define ENABLE_DISCOVERY_UPNP
+// Subscribe to all sensors, and serve their state to clients (needs discovery)
+#define ENABLE_GATEWAY
 
 // Prepare for OTA software installation
 #include <ESP8266mDNS.h>
@@ -33,6 +35,7 @@ static int OTAprev;
 #include "Mail.h"
 
 #include <UPnP/DiscoveryManager.h>
+#include <UPnP/GatewayService.h>
 
 #include "mywifi.h"
 const char* ssid     = MY_SSID;
@@ -153,7 +156,7 @@ void setup() {
   device.setModelURL("http://danny.backx.info");
   device.setManufacturer("Danny Backx");
   device.setManufacturerURL("http://danny.backx.info");
-//  SSDP.begin(device);
+  SSDP.begin(device);
   UPnP.begin(&HTTP, &device);
 
   AlarmService alarm = AlarmService();
@@ -219,17 +222,29 @@ void setup() {
   // ...
 #endif
 
+#if defined(ENABLE_DISCOVERY_UPNP) && defined(ENABLE_GATEWAY)
+  GatewayService gateway = GatewayService();
+  UPnP.addService(&gateway);
+  gateway.begin(&dm);
+#endif
+
   UPNP_DISPLAY.begin();
 
   Serial.printf("Ready!\n");
 
   while (1) {
     HTTP.handleClient();
+    UPnP.periodic();
 #ifdef ENABLE_OTA
     ArduinoOTA.handle();
 #endif
 #ifdef ENABLE_DISCOVERY_UPNP
-    dm.periodic();
+    dm.periodic();		// Includes SSDP.periodic()
+#else
+    SSDP.periodic();
+#endif
+#if defined(ENABLE_DISCOVERY_UPNP) && defined(ENABLE_GATEWAY)
+    gateway.periodic();
 #endif
   }
 }
@@ -86,6 +86,7 @@ static const char *stateString = "State";
 static const char *getStateString = "getState";
 static const char *getVersionString = "getVersion";
 static const char *stringString = "string";
+static const char *motionLevelString = "upnp:warning";
 
 MotionSensorService::MotionSensorService() :
   UPnPService(myServiceName, myServiceType, myServiceId)
@@ -93,6 +94,8 @@ MotionSensorService::MotionSensorService() :
   addAction(getStateString, static_cast<MemberActionFunction>(&MotionSensorService::GetStateHandler), getStateXML);
   addAction(getVersionString, GetVersion, getVersionXML);
   addStateVariable(stateString, stringString, true);
+  setMulticastEvents(stateString, motionLevelString);
+  setEventPriority(stateString, EVENT_PRIORITY_HIGH);
   begin();
 }
 
@@ -102,6 +105,8 @@ MotionSensorService::MotionSensorService(const char *deviceURN) :
   addAction(getStateString, static_cast<MemberActionFunction>(&MotionSensorService::GetStateHandler), getStateXML);
   addAction(getVersionString, GetVersion, getVersionXML);
   addStateVariable(stateString, stringString, true);
+  setMulticastEvents(stateString, motionLevelString);
+  setEventPriority(stateString, EVENT_PRIORITY_HIGH);
   begin();
 }
 
@@ -111,6 +116,8 @@ MotionSensorService::MotionSensorService(const char *serviceType, const char *se
   addAction(getStateString, static_cast<MemberActionFunction>(&MotionSensorService::GetStateHandler), getStateXML);
   addAction(getVersionString, GetVersion, getVersionXML);
   addStateVariable(stateString, stringString, true);
+  setMulticastEvents(stateString, motionLevelString);
+  setEventPriority(stateString, EVENT_PRIORITY_HIGH);
   begin();
 }
 
@@ -136,6 +143,8 @@ void MotionSensorService::begin() {
 #endif
   pinMode(sensorpin, INPUT);
   oldstate = newstate = digitalRead(sensorpin);
+  sprintf(state, "%d", newstate);
+  VariableChanged(stateString, state);
 #ifdef HAVE_LED
   if (ledpin >= 0)
     pinMode(ledpin, OUTPUT);
@@ -155,7 +164,7 @@ void MotionSensorService::poll() {
 //    Serial.printf("State changed to %d (MotionSensorService %p)\n", newstate, this);
 
     // FIXME trigger something from here
-    SendNotify("State");
+    SendNotify(stateString, state);
   }
 }
 
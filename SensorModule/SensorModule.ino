@@ -229,6 +229,7 @@ void setup() {
   Serial.printf("Starting OTA listener...\n");
   ArduinoOTA.onStart([]() {
     Serial.print("OTA Start : ");
+    SSDP.byebye();
   });
   ArduinoOTA.onEnd([]() {
     Serial.println("\nOTA End");
@@ -294,6 +295,8 @@ void setup() {
   while (1) {
     ms_srv.poll();
     HTTP.handleClient();
+    UPnP.periodic();
+    SSDP.periodic();
 #ifdef ENABLE_LED_SERVICE
     led_srv.periodic();
 #endif
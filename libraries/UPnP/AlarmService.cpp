@@ -110,6 +110,7 @@ AlarmService::AlarmService() :
   addStateVariable(fromString, stringString, false);
   addStateVariable(toString, stringString, false);
   addStateVariable(mailHostString, stringString, false);
+  setEventPriority(stateString, EVENT_PRIORITY_HIGH);
   begin();
 }
 
@@ -124,6 +125,7 @@ AlarmService::AlarmService(const char *deviceURN) :
   addStateVariable(fromString, stringString, false);
   addStateVariable(toString, stringString, false);
   addStateVariable(mailHostString, stringString, false);
+  setEventPriority(stateString, EVENT_PRIORITY_HIGH);
   begin();
 }
 
@@ -138,6 +140,7 @@ AlarmService::AlarmService(const char *serviceType, const char *serviceId) :
   addStateVariable(fromString, stringString, false);
   addStateVariable(toString, stringString, false);
   addStateVariable(mailHostString, stringString, false);
+  setEventPriority(stateString, EVENT_PRIORITY_HIGH);
   begin();
 }
 
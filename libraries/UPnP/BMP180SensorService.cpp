@@ -84,6 +84,7 @@ static const char *myServiceId = "urn:danny-backx-info:serviceId:bmp180sensor1";
 static const char *temperatureString = "Temperature";
 static const char *pressureString = "Pressure";
 static const char *percentageString = "Percentage";
+static const char *oversamplingString = "oversampling";
 static const char *getStateString = "getState";
 static const char *getVersionString = "getVersion";
 static const char *stringString = "string";
@@ -101,6 +102,8 @@ BMP180SensorService::BMP180SensorService() :
   oldTemperature = 0;
   oldPressure = 0;
   count = 0;
+  state = BMP180_STATE_IDLE;
+  oversampling = BMP180_OVERSAMPLING_DEFAULT;
 }
 
 BMP180SensorService::BMP180SensorService(const char *deviceURN) :
@@ -115,6 +118,8 @@ BMP180SensorService::BMP180SensorService(const char *deviceURN) :
   oldTemperature = 0;
   oldPressure = 0;
   count = 0;
+  state = BMP180_STATE_IDLE;
+  oversampling = BMP180_OVERSAMPLING_DEFAULT;
 }
 
 BMP180SensorService::BMP180SensorService(const char *serviceType, const char *serviceId) :
@@ -129,6 +134,8 @@ BMP180SensorService::BMP180SensorService(const char *serviceType, const char *se
   oldTemperature = 0;
   oldPressure = 0;
   count = 0;
+  state = BMP180_STATE_IDLE;
+  oversampling = BMP180_OVERSAMPLING_DEFAULT;
 }
 
 BMP180SensorService::~BMP180SensorService() {
@@ -144,10 +151,18 @@ void BMP180SensorService::begin() {
   config = new Configuration("BMP180",
     new ConfigurationItem("name", ""),
     new ConfigurationItem(percentageString, defaultPercentage),
+    new ConfigurationItem(oversamplingString, BMP180_OVERSAMPLING_DEFAULT),
     NULL);
   UPnPService::begin(config);
   percentage = config->GetValue(percentageString);
   name = config->GetStringValue("name");
+  oversampling = constrain(config->GetValue(oversamplingString), 0, 3);
+  config->onChange(oversamplingString,
+    std::bind(&BMP180SensorService::ConfigChanged, this, std::placeholders::_1));
+  config->onChange(percentageString,
+    std::bind(&BMP180SensorService::ConfigChanged, this, std::placeholders::_1));
+  config->onChange("name",
+    std::bind(&BMP180SensorService::ConfigChanged, this, std::placeholders::_1));
 
 #ifdef DEBUG
   DEBUG.printf("BMP180SensorService::begin (%d %%)\n", percentage);
@@ -164,6 +179,13 @@ void BMP180SensorService::begin() {
   }
 }
 
+// A new configuration file was uploaded
+void BMP180SensorService::ConfigChanged(ConfigurationItem *item) {
+  percentage = config->GetValue(percentageString);
+  name = config->GetStringValue("name");	// The old string is gone
+  oversampling = constrain(config->GetValue(oversamplingString), 0, 3);	// From the next measurement
+}
+
 // Return true if a noticable difference
 bool BMP180SensorService::Difference(float oldval, float newval) {
   float cmp1, cmp2;
@@ -209,39 +231,79 @@ bool BMP180SensorService::Difference(float oldval, float newval) {
 /*
  * Query the sensor. This is an I2C device, but all that complexity is in a separate class.
  *
- * This method makes sure we report changes only if they exceed a settable percentage.
- * (Working with float readings requires something like this.)
+ * This is a multi-part query, see the SFE_BMP180 source files : start a conversion,
+ * wait (up to 26 ms for pressure at the highest oversampling), get the result.
+ * We don't wait here : each call does the step that's due and returns,
+ * so the rest of the loop (web server, eventing) keeps running.
  */
 void BMP180SensorService::poll() {
-  bool diff = false, nan = false;
-  
   if (bmp == 0)
     return;
-  count++;
+  if (state != BMP180_STATE_IDLE && (long)(millis() - ready) < 0)
+    return;	// Conversion still busy
 
-  oldTemperature = newTemperature;
-  oldPressure = newPressure;
+  switch (state) {
+  case BMP180_STATE_IDLE: {
+    count++;
+    oldTemperature = newTemperature;
+    oldPressure = newPressure;
 
-  // This is a multi-part query to the I2C device, see the SFE_BMP180 source files.
-  char d1 = bmp->startTemperature();
-  delay(d1);
-  char d2 = bmp->getTemperature(newTemperature);
-  if (d2 == 0) { // Error communicating with device
+    char d1 = bmp->startTemperature();
+    if (d1 == 0) { // Error communicating with device
 #ifdef DEBUG
-    DEBUG.printf("BMP180 : communication error (temperature)\n");
+      DEBUG.printf("BMP180 : communication error (start temperature)\n");
 #endif
-    return;
-  }
-
-  char d3 = bmp->startPressure(0);
-  delay(d3);
-  char d4 = bmp->getPressure(newPressure, newTemperature);
-  if (d4 == 0) { // Error communicating with device
+      return;
+    }
+    ready = millis() + d1 + 1;	// We may be just before a millisecond tick
+    state = BMP180_STATE_TEMPERATURE;
+    break;
+    }
+
+  case BMP180_STATE_TEMPERATURE: {
+    state = BMP180_STATE_IDLE;
+    char d2 = bmp->getTemperature(newTemperature);
+    if (d2 == 0) { // Error communicating with device
 #ifdef DEBUG
-    DEBUG.printf("BMP180 : communication error (pressure)\n");
+      DEBUG.printf("BMP180 : communication error (temperature)\n");
 #endif
-    return;
+      return;
+    }
+    char d3 = bmp->startPressure(oversampling);
+    if (d3 == 0) {
+#ifdef DEBUG
+      DEBUG.printf("BMP180 : communication error (start pressure)\n");
+#endif
+      return;
+    }
+    ready = millis() + d3 + 1;
+    state = BMP180_STATE_PRESSURE;
+    break;
+    }
+
+  case BMP180_STATE_PRESSURE: {
+    state = BMP180_STATE_IDLE;
+    char d4 = bmp->getPressure(newPressure, newTemperature);
+    if (d4 == 0) { // Error communicating with device
+#ifdef DEBUG
+      DEBUG.printf("BMP180 : communication error (pressure)\n");
+#endif
+      return;
+    }
+    Measured();
+    break;
+    }
   }
+}
+
+/*
+ * A full measurement is in.
+ *
+ * This method makes sure we report changes only if they exceed a settable percentage.
+ * (Working with float readings requires something like this.)
+ */
+void BMP180SensorService::Measured() {
+  bool diff = false, nan = false;
 
   if (isnan(newTemperature) || isinf(newTemperature)) {
     newTemperature = oldTemperature;
@@ -265,12 +327,12 @@ void BMP180SensorService::poll() {
 
   if (Difference(oldTemperature, newTemperature)) {
     UpdateTemperature();
-    SendNotify(temperatureString);
+    SendNotify(temperatureString, temperature);
     diff = true;
   }
   if (Difference(oldPressure, newPressure)) {
     UpdatePressure();
-    SendNotify(pressureString);
+    SendNotify(pressureString, pressure);
     diff = true;
   }
 
@@ -293,28 +355,28 @@ void BMP180SensorService::poll() {
 
 const float BMP180SensorService::GetFloatTemperature() {
   if (! inited)
-    poll();	// try once
+    poll();	// move the measurement along
 
   return newTemperature;
 }
 
 const char *BMP180SensorService::GetTemperature() {
   if (! inited)
-    poll();	// try once
+    poll();	// move the measurement along
 
   return temperature;
 }
 
 const float BMP180SensorService::GetFloatPressure() {
   if (! inited)
-    poll();	// try once
+    poll();	// move the measurement along
 
   return newPressure;
 }
 
 const char *BMP180SensorService::GetPressure() {
   if (! inited)
-    poll();	// try once
+    poll();	// move the measurement along
 
   return pressure;
 }
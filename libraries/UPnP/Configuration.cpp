@@ -32,96 +32,324 @@
 #define	DEBUG_PRINT Serial
 // #define	DEBUG_PRINTx Serial
 
-#define LINE_LEN	80
-
 static const char *filename = "/config.txt";
+static const char *binfilename = "/config.bin";
 static const char *filemode = "r";
 
-int UPnPService::ReadLine(File f) {
-  if (line == NULL)
-    line = (char *)malloc(LINE_LEN+1);
+ConfigurationFile ConfigFile;
 
-  int len = f.readBytesUntil('\n', line, LINE_LEN);
-  if (len >= 0 && len <= LINE_LEN)
-    line[len] = 0;
+ConfigurationFile::ConfigurationFile() {
+  loaded = false;
+  image = NULL;
+  header = NULL;
+  entries = NULL;
+  reads = 0;
+  loadtime = 0;
+  nconfigs = 0;
+}
 
-  return len;
+// FNV-1a, case insensitive, continuing from h. Start with 2166136261U.
+uint32_t ConfigurationFile::Hash(const char *s, uint32_t h) {
+  for (const char *p = s; *p; p++)
+    h = (h ^ (uint8_t)tolower(*p)) * 16777619U;
+  return h;
 }
 
-void UPnPService::ReadConfiguration(const char *name, Configuration *config) {
+// FNV-1a of the raw text, to tell whether the image was compiled from it
+uint32_t ConfigurationFile::Checksum(const char *text, uint32_t len) {
+  uint32_t h = 2166136261U;
+  for (uint32_t i=0; i<len; i++)
+    h = (h ^ (uint8_t)text[i]) * 16777619U;
+  return h;
+}
+
+/*
+ * Use the compiled image if it's there and belongs to the current text file,
+ * otherwise compile the text (once) and store the result.
+ * Only done once, all services look things up in the result.
+ * The text is still read to check that : an edit that keeps the size must not go unnoticed.
+ */
+bool ConfigurationFile::Load() {
+  if (loaded)
+    return image != NULL;
+  loaded = true;
+
+  unsigned long start = millis();
+  File f = SPIFFS.open(filename, filemode);
+  if (! f)
+    return false;
+  uint32_t textsize = f.size();
+  char *text = (char *)malloc(textsize + 1);
+  if (text == NULL) {
+    f.close();
+    return false;
+  }
+  int len = f.readBytes(text, textsize);
+  text[len] = 0;
+  f.close();
+  reads++;
+  uint32_t checksum = Checksum(text, len);
+
+  if (ReadImage(textsize, checksum)) {
+    free(text);
+  } else {
+    bool ok = Compile(text, textsize, checksum);
+    free(text);
+    if (! ok)
+      return false;
+
+    File b = SPIFFS.open(binfilename, "w");
+    if (b) {
+      b.write((const uint8_t *)image, header->size);
+      b.close();
+    }
+  }
+
+  loadtime = millis() - start;
 #ifdef DEBUG_PRINT
-  DEBUG_PRINT.printf("ReadConfiguration(%s)\n", name);
+  DEBUG_PRINT.printf("ConfigurationFile : %d entries, %d bytes, %lu ms\n",
+    header->count, header->size, loadtime);
 #endif
+  return true;
+}
 
-  // Open file
-  File f = SPIFFS.open(filename, filemode);
+bool ConfigurationFile::ReadImage(uint32_t textsize, uint32_t checksum) {
+  File b = SPIFFS.open(binfilename, filemode);
+  if (! b)
+    return false;
+  uint32_t size = b.size();
+  if (size < sizeof(struct ConfigurationHeader) || size > 0xFFFF) {
+    b.close();
+    return false;
+  }
+
+  image = (char *)malloc(size);
+  if (image == NULL) {
+    b.close();
+    return false;
+  }
+  int len = b.readBytes(image, size);
+  b.close();
+  reads++;
+
+  // Sanity checks, and is it the text file we compiled
+  header = (struct ConfigurationHeader *)image;
+  entries = (struct ConfigurationEntry *)(header + 1);
+  if (len != size || header->magic != CONFIG_MAGIC || header->size != size
+      || header->textsize != textsize || header->checksum != checksum
+      || sizeof(struct ConfigurationHeader) + header->count * sizeof(struct ConfigurationEntry) > size) {
+    Unload();
+    loaded = true;
+    return false;
+  }
+  return true;
+}
 
-  int len;
-  do {
-    // Read line
-    len = ReadLine(f);
-#ifdef DEBUG_PRINTx
-    DEBUG_PRINT.printf("Read line %d {%s}\n", len, line);
+static int compare_entries(const void *a, const void *b) {
+  uint32_t ha = ((const struct ConfigurationEntry *)a)->hash,
+           hb = ((const struct ConfigurationEntry *)b)->hash;
+  return (ha < hb) ? -1 : (ha > hb);
+}
+
+/*
+ * Turn the text into an image. The text is split into strings in place first,
+ * then copied into the image after the directory.
+ */
+bool ConfigurationFile::Compile(char *text, uint32_t textsize, uint32_t checksum) {
+  const char *fields[CONFIG_MAX_ENTRIES][3];
+  int n = 0, pool = 0, dropped = 0;
+
+  char *line = text;
+  while (line && *line) {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = 0;
+    char *cr = strchr(line, '\r');
+    if (cr)
+      *cr = 0;
+
+    char *key = strchr(line, ':');
+    char *value = key ? strchr(key + 1, ':') : NULL;
+    if (value && n >= CONFIG_MAX_ENTRIES) {
+      dropped++;
+    } else if (value) {
+      *key++ = 0;
+      *value++ = 0;
+      fields[n][0] = line;
+      fields[n][1] = key;
+      fields[n][2] = value;
+      pool += strlen(line) + strlen(key) + strlen(value) + 3;
+      n++;
+    }
+    line = next;
+  }
+#ifdef DEBUG_PRINT
+  if (dropped)
+    DEBUG_PRINT.printf("ConfigurationFile : more than %d entries, %d lines ignored\n",
+      CONFIG_MAX_ENTRIES, dropped);
 #endif
 
-    // Check it against every configuration item
-    char *t1 = line, *t2 = NULL, *t3 = NULL;
-    int i;
+  uint32_t size = sizeof(struct ConfigurationHeader) + n * sizeof(struct ConfigurationEntry) + pool;
+  if (size > 0xFFFF)
+    return false;
+  image = (char *)malloc(size);
+  if (image == NULL)
+    return false;
 
-    // Scan the line for a colon, separate the fields on it.
-    for (i=0; i<len && line[i]; i++)
-      if (line[i] == ':') {
-        line[i] = 0;
-	t2 = line+i+1;
-	break;
-      }
+  header = (struct ConfigurationHeader *)image;
+  entries = (struct ConfigurationEntry *)(header + 1);
+  header->magic = CONFIG_MAGIC;
+  header->textsize = textsize;
+  header->checksum = checksum;
+  header->count = n;
+  header->size = size;
+
+  char *strings = (char *)(entries + n);
+  for (int i=0; i<n; i++) {
+    struct ConfigurationEntry *e = &entries[i];
+    uint16_t off[3];
+    for (int j=0; j<3; j++) {
+      off[j] = strings - image;
+      strcpy(strings, fields[i][j]);
+      strings += strlen(fields[i][j]) + 1;
+    }
+    e->section = off[0];
+    e->key = off[1];
+    e->value = off[2];
+    e->hash = Hash(fields[i][1], Hash(fields[i][0], 2166136261U));
+
+    // Numbers are converted now, not at every lookup
+    char *end;
+    e->ivalue = strtol(fields[i][2], &end, 10);
+    e->type = (fields[i][2][0] && *end == 0) ? CONFIG_VALUE_INT : CONFIG_VALUE_STRING;
+    e->pad = 0;
+  }
+  qsort(entries, n, sizeof(struct ConfigurationEntry), compare_entries);
+  return true;
+}
 
-    // Is the configuration line about this device ?
-    if (strcmp(t1, name) != 0)
-      continue;
+void ConfigurationFile::Unload() {
+  free(image);
+  image = NULL;
+  header = NULL;
+  entries = NULL;
+  loaded = false;
+}
 
-    // Continue scanning for the next colon
-    for (i++; i<len && line[i]; i++)
-      if (line[i] == ':') {
-        line[i] = 0;
-	t3 = line+i+1;
-	break;
-      }
-
-    // Configuration line matching a config item ?
-    ConfigurationItem *item = config->GetItem(t2);
-    if (item) {
-	switch (item->GetType()) {
-	  case TYPE_NONE:
-	    break;
-	  case TYPE_DEFAULT_INT:
-	  case TYPE_INT:
-	    item->SetValue(atoi(t3));
+/*
+ * A file was uploaded to our web server : if it's the configuration, compile it again,
+ * and hand the changes to the live services. Nothing restarts, subscriptions stay.
+ */
+void ConfigurationFile::FileStored(const char *path) {
+  if (strcmp(path, filename) != 0)
+    return;
+  Unload();
+  SPIFFS.remove(binfilename);
+  Load();
+
+  int n = 0;
+  for (int i=0; i<nconfigs; i++)
+    n += configs[i]->Reload();
 #ifdef DEBUG_PRINT
-        DEBUG_PRINT.printf("Configuration match for %s %s {%d}\n", t1, t2, atoi(t3));
+  DEBUG_PRINT.printf("ConfigurationFile : reload, %d items changed\n", n);
 #endif
-	    break;
-	  case TYPE_DEFAULT_STRING:
-	  case TYPE_STRING:
-	    item->SetValue(t3);
+}
+
+void ConfigurationFile::Register(Configuration *config) {
+  if (nconfigs < CONFIG_MAX_CONFIGURATIONS)
+    configs[nconfigs++] = config;
+}
+
+const struct ConfigurationEntry *ConfigurationFile::FindEntry(const char *section, const char *key) {
+  if (section == NULL || key == NULL || ! Load())
+    return NULL;
+
+  uint32_t h = Hash(key, Hash(section, 2166136261U));
+  int lo = 0, hi = header->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (entries[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // lo is the first entry with this hash, if any
+  for (; lo < header->count && entries[lo].hash == h; lo++)
+    if (strcasecmp(image + entries[lo].section, section) == 0
+        && strcasecmp(image + entries[lo].key, key) == 0)
+      return &entries[lo];
+  return NULL;
+}
+
+const char *ConfigurationFile::Find(const char *section, const char *key) {
+  const struct ConfigurationEntry *e = FindEntry(section, key);
+  return e ? image + e->value : NULL;
+}
+
+const char *ConfigurationFile::GetString(uint16_t offset) {
+  return image + offset;
+}
+
+int ConfigurationFile::getReads() {
+  return reads;
+}
+
+unsigned long ConfigurationFile::getLoadTime() {
+  return loadtime;
+}
+
+void UPnPService::ReadConfiguration(const char *name, Configuration *config) {
 #ifdef DEBUG_PRINT
-        DEBUG_PRINT.printf("Configuration match for %s %s {%s}\n", t1, t2, t3);
+  DEBUG_PRINT.printf("ReadConfiguration(%s)\n", name);
 #endif
-	    break;
-	}
-    } else {
-#ifdef DEBUG_PRINTx
-        DEBUG_PRINT.printf("Configuration item for %s : NULL\n", t2);
+  config->Load();
+}
+
+// Pick up the values for this configuration from the file
+void Configuration::Load() {
+  for (int i=0; i<nitems; i++) {
+    const struct ConfigurationEntry *e = ConfigFile.FindEntry(name, items[i]->GetName());
+    if (e == NULL)
+      continue;
+    const char *value = ConfigFile.GetString(e->value);
+    enum ValueType t = items[i]->GetType();
+    if (e->type == CONFIG_VALUE_INT && (t == TYPE_DEFAULT_INT || t == TYPE_INT))
+      items[i]->Apply(e->ivalue);
+    else
+      items[i]->Apply(value);
+#ifdef DEBUG_PRINT
+    DEBUG_PRINT.printf("Configuration match for %s %s {%s}\n", name, items[i]->GetName(), value);
 #endif
-    }
-  } while (len > 0);
+  }
+}
 
-  // Close file
-  f.close();
+/*
+ * After the file changed : bring each item to its new value (or back to its default
+ * when the file no longer mentions it). Callbacks only run for items that changed,
+ * and only after the whole section is updated, so they see consistent values.
+ */
+int Configuration::Reload() {
+  uint32_t changed = 0;		// Bit per item
+  int n = 0;
+
+  for (int i=0; i<nitems && i<32; i++)
+    if (items[i]->Update(ConfigFile.FindEntry(name, items[i]->GetName()))) {
+      changed |= (1 << i);
+      n++;
+#ifdef DEBUG_PRINT
+      DEBUG_PRINT.printf("Configuration change for %s %s\n", name, items[i]->GetName());
+#endif
+    }
+  for (int i=0; i<nitems && i<32; i++)
+    if (changed & (1 << i))
+      items[i]->Changed();
+  return n;
+}
 
-  // Return
-  free(line);
-  line = NULL;
+void Configuration::onChange(const char *itemname, ConfigurationCallback cb) {
+  ConfigurationItem *ci = GetItem(itemname);
+  if (ci)
+    ci->onChange(cb);
 }
 
 Configuration::Configuration(const char *name, ConfigurationItem *item ...) {
@@ -151,26 +379,36 @@ Configuration::Configuration(const char *name, ConfigurationItem *item ...) {
     p = va_arg(args, ConfigurationItem *);
   }
   va_end(args);
+
+  ConfigFile.Register(this);
 }
 
 ConfigurationItem::ConfigurationItem(const char *name, int value) {
   this->name = name;
+  this->hash = ConfigurationFile::Hash(name, 2166136261U);
   this->ivalue = value;
+  this->idefault = value;
   this->type = TYPE_DEFAULT_INT;
   this->svalue = NULL;
+  this->sdefault = NULL;
 }
 
 ConfigurationItem::ConfigurationItem(const char *name, const char *value) {
   this->name = name;
-  char *s = (char *)malloc(strlen(value)+1);
-  strcpy(s, value);
-  this->svalue = s;
+  this->hash = ConfigurationFile::Hash(name, 2166136261U);
+  this->ivalue = 0;
+  this->idefault = 0;
+  this->svalue = value ? strdup(value) : NULL;
+  this->sdefault = value ? strdup(value) : NULL;
   this->type = TYPE_DEFAULT_STRING;
 }
 
 ConfigurationItem *Configuration::GetItem(const char *itemname) {
+  if (itemname == NULL)
+    return NULL;
+  uint32_t h = ConfigurationFile::Hash(itemname, 2166136261U);
   for (int i=0; i<nitems; i++) {
-    if (itemname && items[i] && items[i]->GetName() && strcasecmp(itemname, items[i]->GetName()) == 0) {
+    if (items[i] && items[i]->GetHash() == h && strcasecmp(itemname, items[i]->GetName()) == 0) {
       return items[i];
     }
   }
@@ -185,6 +423,10 @@ const char *ConfigurationItem::GetName() {
   return name;
 }
 
+uint32_t ConfigurationItem::GetHash() {
+  return hash;
+}
+
 int Configuration::GetValue(const char *name) {
   if (name == NULL) {
     return 0;
@@ -212,6 +454,78 @@ void ConfigurationItem::SetValue(int v) {
   ivalue = v;
 }
 
+// A number from the compiled configuration, only for numeric items
+void ConfigurationItem::Apply(int v) {
+  if (type == TYPE_DEFAULT_INT || type == TYPE_INT) {
+    SetValue(v);
+    type = TYPE_INT;
+  }
+}
+
+// A value from the configuration file, as text
+void ConfigurationItem::Apply(const char *text) {
+  switch (type) {
+  case TYPE_NONE:
+    break;
+  case TYPE_DEFAULT_INT:
+  case TYPE_INT:
+    SetValue(atoi(text));
+    type = TYPE_INT;
+    break;
+  case TYPE_DEFAULT_STRING:
+  case TYPE_STRING:
+    SetValue((char *)text);
+    type = TYPE_STRING;
+    break;
+  }
+}
+
+/*
+ * Take the value from this entry of the compiled file, or the default if there's none.
+ * Returns whether anything a service could see changed (the value, or configured()).
+ */
+bool ConfigurationItem::Update(const struct ConfigurationEntry *e) {
+  enum ValueType was = type;
+
+  switch (type) {
+  case TYPE_NONE:
+    return false;
+  case TYPE_DEFAULT_INT:
+  case TYPE_INT: {
+    int old = ivalue;
+    if (e == NULL) {
+      SetValue(idefault);
+      type = TYPE_DEFAULT_INT;
+    } else if (e->type == CONFIG_VALUE_INT)
+      Apply(e->ivalue);
+    else
+      Apply(ConfigFile.GetString(e->value));
+    return old != ivalue || was != type;
+    }
+  case TYPE_DEFAULT_STRING:
+  case TYPE_STRING: {
+    const char *v = e ? ConfigFile.GetString(e->value) : sdefault;
+    bool diff = (v == NULL || svalue == NULL) ? (v != svalue) : (strcmp(v, svalue) != 0);
+    if (diff) {
+      free((void *)svalue);
+      svalue = v ? strdup(v) : NULL;
+    }
+    type = e ? TYPE_STRING : TYPE_DEFAULT_STRING;
+    return diff || was != type;
+    }
+  }
+  return false;
+}
+
+void ConfigurationItem::onChange(ConfigurationCallback cb) {
+  changed = cb;
+}
+
+void ConfigurationItem::Changed() {
+  if (changed)
+    changed(this);
+}
+
 char *Configuration::GetStringValue(const char *name) {
   ConfigurationItem *ci = GetItem(name);
   if (ci)
@@ -191,7 +191,7 @@ void DHTSensorService::poll() {
   if (oldtemperature != newtemperature) {
     sprintf(state, "%d", newtemperature);
 
-    SendNotify("State");
+    SendNotify("State", state);
 #ifdef DEBUG
     DEBUG.print("DHT: temp ");
     DEBUG.print(newtemperature);
@@ -0,0 +1,309 @@
+/*
+ * Fetch the description (LOCATION URL) of discovered devices in the background,
+ * and remember what they offer.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+
+#include "UPnP/DescriptionFetcher.h"
+#include "UPnP/WebClient.h"
+
+// #undef DEBUG
+#define DEBUG Serial
+
+static const char *_description_request_template =
+  "GET %s HTTP/1.0\r\n"
+  "HOST: %s:%d\r\n"
+  "CONNECTION: close\r\n"
+  "\r\n";
+
+// Parser states
+#define	PARSE_HEADERS	0
+#define	PARSE_TEXT	1
+#define	PARSE_TAG	2
+
+// Elements we collect, see Element()
+#define	CAPTURE_NONE		0
+#define	CAPTURE_DEVICETYPE	1
+#define	CAPTURE_FRIENDLYNAME	2
+#define	CAPTURE_SERVICETYPE	3
+#define	CAPTURE_CONTROLURL	4
+#define	CAPTURE_EVENTSUBURL	5
+
+static const char *capture_tags[] = { NULL, "deviceType", "friendlyName", "serviceType",
+  "controlURL", "eventSubURL" };
+
+DescriptionFetcher::DescriptionFetcher() {
+  for (int i=0; i<DESCRIPTION_CACHE_SIZE; i++) {
+    cache[i].state = DESCRIPTION_FREE;
+    cache[i].hash = 0;
+    cache[i].location = cache[i].deviceType = cache[i].friendlyName = NULL;
+    cache[i].nservices = 0;
+  }
+  for (int i=0; i<DESCRIPTION_MAX_CONNECTIONS; i++)
+    fetches[i].caps = NULL;
+  victim = 0;
+  callback = NULL;
+}
+
+DescriptionFetcher::~DescriptionFetcher() {
+  for (int i=0; i<DESCRIPTION_MAX_CONNECTIONS; i++)
+    if (fetches[i].caps)
+      fetches[i].client.stop();
+  for (int i=0; i<DESCRIPTION_CACHE_SIZE; i++)
+    Clear(&cache[i]);
+}
+
+void DescriptionFetcher::Clear(struct DeviceCapabilities *caps) {
+  free(caps->location);
+  free(caps->deviceType);
+  free(caps->friendlyName);
+  for (int i=0; i<caps->nservices; i++) {
+    free(caps->services[i]);
+    free(caps->controlURL[i]);
+    free(caps->eventSubURL[i]);
+  }
+  caps->location = caps->deviceType = caps->friendlyName = NULL;
+  caps->nservices = 0;
+  caps->state = DESCRIPTION_FREE;
+  caps->hash = 0;
+}
+
+void DescriptionFetcher::onFetched(DescriptionCallback cb) {
+  callback = cb;
+}
+
+struct DeviceCapabilities *DescriptionFetcher::Find(uint64_t hash) {
+  for (int i=0; i<DESCRIPTION_CACHE_SIZE; i++)
+    if (cache[i].state != DESCRIPTION_FREE && cache[i].hash == hash)
+      return &cache[i];
+  return NULL;
+}
+
+/*
+ * Make sure we know (or will soon know) what this device offers.
+ * Nothing happens if we already have its description for this boot.
+ */
+void DescriptionFetcher::Request(uint64_t hash, uint32_t bootid, const char *location) {
+  if (location == NULL)
+    return;
+
+  struct DeviceCapabilities *caps = Find(hash);
+  if (caps) {
+    if (caps->bootid == bootid && strcmp(caps->location, location) == 0)
+      return;		// Done, or on its way
+    if (caps->state == DESCRIPTION_FETCHING)
+      return;		// Let this one finish first, we'll be asked again
+    Clear(caps);
+  } else {
+    // Find a free entry, or reuse one that is not being fetched
+    for (int i=0; i<DESCRIPTION_CACHE_SIZE && caps == NULL; i++)
+      if (cache[i].state == DESCRIPTION_FREE)
+        caps = &cache[i];
+    for (int i=0; i<DESCRIPTION_CACHE_SIZE && caps == NULL; i++) {
+      struct DeviceCapabilities *c = &cache[victim];
+      victim = (victim + 1) % DESCRIPTION_CACHE_SIZE;
+      if (c->state != DESCRIPTION_FETCHING) {
+        Clear(c);
+        caps = c;
+      }
+    }
+    if (caps == NULL)
+      return;
+  }
+
+  caps->hash = hash;
+  caps->bootid = bootid;
+  caps->location = strdup(location);
+  caps->state = DESCRIPTION_PENDING;
+}
+
+/*
+ * Call this from the main loop : start fetches, and handle whatever data has arrived.
+ */
+void DescriptionFetcher::periodic() {
+  for (int i=0; i<DESCRIPTION_MAX_CONNECTIONS; i++) {
+    struct Fetch *f = &fetches[i];
+
+    if (f->caps == NULL) {
+      // Free connection : pick up a device waiting for one, or a failure to retry
+      for (int j=0; j<DESCRIPTION_CACHE_SIZE; j++) {
+        struct DeviceCapabilities *c = &cache[j];
+        if (c->state == DESCRIPTION_PENDING
+            || (c->state == DESCRIPTION_FAILED && (long)(millis() - c->retry) >= 0)) {
+          Start(f, c);
+          break;
+        }
+      }
+      continue;
+    }
+
+    char buf[128];
+    int n;
+    while ((n = f->client.available()) > 0) {
+      n = f->client.read((uint8_t *)buf, (n > sizeof(buf)) ? sizeof(buf) : n);
+      if (n <= 0)
+        break;
+      Parse(f, buf, n);
+    }
+
+    if (! f->client.connected())
+      Finish(f, f->state != PARSE_HEADERS);
+    else if ((long)(millis() - f->deadline) >= 0)
+      Finish(f, false);
+  }
+}
+
+bool DescriptionFetcher::Start(struct Fetch *f, struct DeviceCapabilities *caps) {
+  const char *url = caps->location, *path;
+  char host[40];
+  uint16_t port;
+  if (! WebClient::parseURL(url, host, sizeof(host), port, path)) {
+    caps->state = DESCRIPTION_DONE;	// Nothing we can do with this
+    return false;
+  }
+
+#ifdef DEBUG
+  DEBUG.printf("DescriptionFetcher : %s\n", url);
+#endif
+  // Note : connecting is not asynchronous in this core, but on a LAN it's quick.
+  if (! f->client.connect(host, port)) {
+    caps->state = DESCRIPTION_FAILED;
+    caps->retry = millis() + DESCRIPTION_RETRY;
+    return false;
+  }
+  f->client.printf(_description_request_template, path, host, port);
+
+  caps->state = DESCRIPTION_FETCHING;
+  f->caps = caps;
+  f->deadline = millis() + DESCRIPTION_TIMEOUT;
+  f->state = PARSE_HEADERS;
+  f->eoh = 0;
+  f->capture = CAPTURE_NONE;
+  f->service = -1;
+  f->taglen = f->textlen = 0;
+  return true;
+}
+
+void DescriptionFetcher::Finish(struct Fetch *f, bool ok) {
+  struct DeviceCapabilities *caps = f->caps;
+  f->client.stop();
+  f->caps = NULL;
+
+  if (ok && caps->deviceType) {
+    caps->state = DESCRIPTION_DONE;
+#ifdef DEBUG
+    DEBUG.printf("DescriptionFetcher : %s is a %s, %d services\n",
+      caps->friendlyName ? caps->friendlyName : "?", caps->deviceType, caps->nservices);
+#endif
+    if (callback)
+      callback(caps);
+  } else {
+    caps->state = DESCRIPTION_FAILED;
+    caps->retry = millis() + DESCRIPTION_RETRY;
+  }
+}
+
+/*
+ * Streaming parser : we get the document in pieces, whatever the network gives us.
+ * Skip the HTTP headers, then only collect the text of a few elements.
+ * The URLs of a service follow its serviceType.
+ */
+void DescriptionFetcher::Parse(struct Fetch *f, const char *buf, int len) {
+  static const char *eoh = "\r\n\r\n";
+
+  for (int i=0; i<len; i++) {
+    char c = buf[i];
+    switch (f->state) {
+    case PARSE_HEADERS:
+      f->eoh = (c == eoh[f->eoh]) ? f->eoh + 1 : (c == '\r');
+      if (f->eoh == 4)
+        f->state = PARSE_TEXT;
+      break;
+    case PARSE_TEXT:
+      if (c == '<') {
+        f->state = PARSE_TAG;
+        f->taglen = 0;
+      } else if (f->capture && f->textlen < sizeof(f->text) - 1)
+        f->text[f->textlen++] = c;
+      break;
+    case PARSE_TAG:
+      if (c == '>') {
+        f->tag[f->taglen] = 0;
+        Element(f);
+        f->state = PARSE_TEXT;
+      } else if (f->taglen < sizeof(f->tag) - 1)
+        f->tag[f->taglen++] = c;
+      break;
+    }
+  }
+}
+
+// A tag was read completely (in f->tag, without the < >)
+void DescriptionFetcher::Element(struct Fetch *f) {
+  struct DeviceCapabilities *caps = f->caps;
+
+  if (f->tag[0] == '/') {
+    if (f->capture && strcmp(f->tag + 1, capture_tags[f->capture]) == 0) {
+      f->text[f->textlen] = 0;
+      switch (f->capture) {
+      case CAPTURE_DEVICETYPE:
+        if (caps->deviceType == NULL)		// The root device comes first
+          caps->deviceType = strdup(f->text);
+        break;
+      case CAPTURE_FRIENDLYNAME:
+        if (caps->friendlyName == NULL)
+          caps->friendlyName = strdup(f->text);
+        break;
+      case CAPTURE_SERVICETYPE:
+        f->service = -1;
+        if (caps->nservices < DESCRIPTION_MAX_SERVICES) {
+          f->service = caps->nservices++;
+          caps->services[f->service] = strdup(f->text);
+          caps->controlURL[f->service] = caps->eventSubURL[f->service] = NULL;
+        }
+        break;
+      case CAPTURE_CONTROLURL:
+        if (f->service >= 0 && caps->controlURL[f->service] == NULL)
+          caps->controlURL[f->service] = strdup(f->text);
+        break;
+      case CAPTURE_EVENTSUBURL:
+        if (f->service >= 0 && caps->eventSubURL[f->service] == NULL)
+          caps->eventSubURL[f->service] = strdup(f->text);
+        break;
+      }
+    }
+    f->capture = CAPTURE_NONE;
+    return;
+  }
+
+  // Opening tag, ignore attributes
+  char *p = strchr(f->tag, ' ');
+  if (p)
+    *p = 0;
+  f->capture = CAPTURE_NONE;
+  for (int i=CAPTURE_DEVICETYPE; i<=CAPTURE_EVENTSUBURL; i++)
+    if (strcmp(f->tag, capture_tags[i]) == 0) {
+      f->capture = i;
+      f->textlen = 0;
+    }
+}
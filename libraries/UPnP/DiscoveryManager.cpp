@@ -29,43 +29,57 @@
 #include "UPnP.h"
 #include "UPnP/UPnPService.h"
 #include "UPnP/DiscoveryManager.h"
+#include "UPnP/SSDPParser.h"
 #include "UPnP/WebServer.h"
 
-#include "WiFiUdp.h"
-#include "lwip/udp.h"
-#include "lwip/igmp.h"
-#include "include/UdpContext.h"
+#include "UPnP/SSDP.h"
 
 // #undef DEBUG
 #define DEBUG Serial
 
 static const char *sensor_uuid_prefix = "38323636-4558-4dda-9188-cda0e6";
 
-static const IPAddress SSDP_MULTICAST_ADDR(239, 255, 255, 250);
-// #define SSDP_INTERVAL     1200
-#define SSDP_PORT         1900
-// #define SSDP_METHOD_SIZE  10
-// #define SSDP_URI_SIZE     2
-// #define SSDP_BUFFER_SIZE  64
-#define SSDP_MULTICAST_TTL 1
-
 static const char *ssdp_all_st = "ssdp:all";
 static const char *upnp_rootdevice_st = "upnp:rootdevice";
+static const char *sensor_st = "urn:danny-backx-info:service:sensor:1";
 
 DiscoveryManager::DiscoveryManager() : UPnPService() {
-  packet = NULL;
-  buffer = NULL;
-  devices = NULL;
-  ndevices = maxdevices = 0;
-  udpctx = 0;
+  ndevices = 0;
+  querylen = 0;
+  querycopies = 0;
+  queryat = 0;
+  interval = DISCOVERY_SEARCH_INTERVAL;
+  backoff = DISCOVERY_SEARCH_MIN;
+  expected = 0;
+  latency = 0;
+  ticktime = 0;
+  callback = NULL;
+
+  for (int i=0; i<DISCOVER_BUCKETS; i++)
+    buckets[i] = -1;
+  for (int i=0; i<DISCOVER_MAX_DEVICES; i++) {
+    devices[i].hash = 0;
+    devices[i].wprev = devices[i].wnext = -1;
+    devices[i].wslot = 0;
+    devices[i].next = (i == DISCOVER_MAX_DEVICES-1) ? -1 : i+1;
+  }
+  freelist = 0;
+  for (int i=0; i<PRESENCE_WHEEL_SLOTS; i++)
+    wheel[i] = -1;
+  wheelpos = 0;
+  for (int i=0; i<DISCOVER_MAX_STRINGS; i++) {
+    strings[i].refs = 0;
+    strings[i].s = NULL;
+  }
 }
 
 DiscoveryManager::~DiscoveryManager() {
 #ifdef DEBUG
   DEBUG.println("DiscoveryManager DTOR");
 #endif  
-  if (devices)
-    free(devices);
+  for (int i=0; i<DISCOVER_MAX_STRINGS; i++)
+    if (strings[i].s)
+      free(strings[i].s);
 }
 
 void DiscoveryManager::begin() {
@@ -84,6 +98,13 @@ void DiscoveryManager::begin() {
   DEBUG.printf("DiscoveryManager::begin\n");
 #endif
 
+  // Share the SSDP socket, also with the device side if this node has one
+  SSDP.listen();
+  SSDP.addConsumer(std::bind(&DiscoveryManager::ProcessMessage, this,
+    std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+
+  // Device descriptions are fetched in the background, see AddDevice()
+  fetcher.onFetched(std::bind(&DiscoveryManager::DescriptionFetched, this, std::placeholders::_1));
 }
 
 void DiscoveryManager::AddConfiguredServers() {
@@ -97,15 +118,20 @@ static char *searchMulticastSSDPtemplate =
   "ST: %s\r\n"
   "USER-AGENT: Arduino UPnP/2.0 Danny Backx Motion Sensor Kit/0.1\r\n"
   "CPFN.UPNP.ORG: %s\r\n"
-  "CPUUID.UPNP.ORG: %s\r\n"
+  "%s"
   "\r\n";
 
+// Optional, only when we have a device UUID
+static const char *cpuuidTemplate = "CPUUID.UPNP.ORG: %s\r\n";
+
+// Parameters : device address, port, its uuid (length, string)
 static char *searchUnicastSSDPtemplate =
   "M-SEARCH * HTTP/1.1\r\n"
-  "HOST: 239.255.255.250:1900\r\n"
+  "HOST: %s:%d\r\n"
   "MAN: \"SSDP:discover\"\r\n"
-  "ST: %s\r\n"
-  "USER-AGENT: Arduino UPnP/2.0 Danny Backx Motion Sensor Kit/0.1\r\n";
+  "ST: %.*s\r\n"
+  "USER-AGENT: Arduino UPnP/2.0 Danny Backx Motion Sensor Kit/0.1\r\n"
+  "\r\n";
 
 void DiscoveryManager::receivePacket() {
 #ifdef DEBUG
@@ -113,66 +139,89 @@ void DiscoveryManager::receivePacket() {
 #endif
 }
 
+/*
+ * Search for our sensors : they all offer this service type, so only they answer.
+ */
 bool DiscoveryManager::QuerySensors() {
   // return QuerySensors(ssdp_all_st);
-  return QuerySensors(upnp_rootdevice_st);
+  // return QuerySensors(upnp_rootdevice_st);
+  return QuerySensors(sensor_st);
 }
 
+/*
+ * Nothing is sent from here, periodic() does that :
+ * - the first search after a random delay : after a power cut, all controllers would
+ *   otherwise search at the same moment,
+ * - each search is sent DISCOVERY_SEARCH_COPIES times (UDP is unreliable), spaced a bit,
+ * - searches are repeated, the interval doubling from DISCOVERY_SEARCH_MIN up to
+ *   the one set with setSearchInterval().
+ */
 bool DiscoveryManager::QuerySensors(const char *st) {
 #ifdef DEBUG
     DEBUG.print("DiscoveryManager::QuerySensors(");
     DEBUG.print(st);
     DEBUG.println(")");
 #endif
-  packet = (char *)malloc(strlen(searchMulticastSSDPtemplate) + 45);
-  sprintf(packet, searchMulticastSSDPtemplate, st, "My alarm controller", "FIXMEe");
-  int len = strlen(packet);
+  char cpuuid[64] = "";
+  const char *uuid = SSDP.getUuid();
+  if (uuid)
+    snprintf(cpuuid, sizeof(cpuuid), cpuuidTemplate, uuid);
+
+  querylen = snprintf(query, sizeof(query), searchMulticastSSDPtemplate, st, "My alarm controller", cpuuid);
+  if (querylen >= sizeof(query)) {
+    querylen = 0;
+    return false;
+  }
 
-  IPAddress multi, local;
-  multi = SSDP_MULTICAST_ADDR;
-  local = WiFi.localIP();
+  // Responses come back to the SSDP socket, see ProcessMessage()
+  SSDP.listen();
 
-  udp.begin(SSDP_PORT);
+  searchstart = millis();
+  latency = 0;
+  backoff = DISCOVERY_SEARCH_MIN;
+  querycopies = DISCOVERY_SEARCH_COPIES;
+  queryat = millis() + UPnPClass::jitter(DISCOVERY_QUERY_SPREAD);
+  return true;
+}
 
-  // Make sure we're in the right multicast group to receive messages
-  if (udpctx) {
-    udpctx->unref();
-    udpctx = 0;
-  }
+// Send the search (or one copy of it) when it's due, schedule the next one.
+void DiscoveryManager::Search() {
+  if (querylen == 0 || (long)(millis() - queryat) < 0)
+    return;
 
-  udpctx = new UdpContext;
-  udpctx->ref();
+  if (querycopies == 0)
+    querycopies = DISCOVERY_SEARCH_COPIES;	// Next round
+  SSDP.multicast(query, querylen);
+  querycopies--;
 
-  ip_addr_t ifaddr;
-  ifaddr.addr = WiFi.localIP();
-  ip_addr_t multicast_addr;
-  multicast_addr.addr = (uint32_t) SSDP_MULTICAST_ADDR;
-  if (igmp_joingroup(&ifaddr, &multicast_addr) != ERR_OK ) {
-    DEBUGV("SSDP failed to join igmp group");
-    return false;
-  }
-  if (!udpctx->listen(*IP_ADDR_ANY, SSDP_PORT)) {
-    return false;
-  }
-  udpctx->setMulticastInterface(ifaddr);
-  // left something out here
-  if (!udpctx->connect(multicast_addr, SSDP_PORT)) {
-    return false;
+  if (querycopies) {
+    // Spread the copies a bit, waiting up to twice as long each time.
+    queryat = millis() + UPnPClass::jitter(50 << (DISCOVERY_SEARCH_COPIES - querycopies));
+    return;
   }
-  // End setting up multicast group
-
-  // UPnP docs say transmit this three times in quick succession
-  udp.beginPacketMulticast(multi, SSDP_PORT, local, 1);
-  udp.write(packet, len);
-  udp.endPacket();
-  delay(50);
-  udp.beginPacketMulticast(multi, SSDP_PORT, local, 1);
-  udp.write(packet, len);
-  udp.endPacket();
-  delay(50);
-  udp.beginPacketMulticast(multi, SSDP_PORT, local, 1);
-  udp.write(packet, len);
-  udp.endPacket();
+
+  // Once all the devices we expect are there, only search at the slow pace
+  if (expected && ndevices >= expected)
+    backoff = interval;
+  queryat = millis() + backoff * 1000UL;
+  backoff *= 2;
+  if (backoff > interval)
+    backoff = interval;
+}
+
+// How often (seconds) to search, at most. Faster while not all devices are known.
+void DiscoveryManager::setSearchInterval(unsigned int seconds) {
+  interval = (seconds < DISCOVERY_SEARCH_MIN) ? DISCOVERY_SEARCH_MIN : seconds;
+}
+
+// Measure how long it takes until this many devices are known, see getDiscoveryLatency().
+void DiscoveryManager::setExpectedDevices(int n) {
+  expected = n;
+}
+
+// Time (ms) it took from QuerySensors() to finding all expected devices. 0 if not yet.
+unsigned long DiscoveryManager::getDiscoveryLatency() {
+  return latency;
 }
 
 #ifdef DEBUG
@@ -187,25 +236,17 @@ void DiscoveryManager::periodic() {
   // Be quick about picking up packets and processing them, don't print too much
   // debugging info e.g. to Serial because that will cause packet loss.
 
-  int len = udp.parsePacket();
-  while (len) {
-    IPAddress remoteIP = udp.remoteIP();
-    uint16_t remotePort = udp.remotePort();
+  Search();
 
-#ifdef DEBUGx
-    DEBUG.printf("UDP packet received : len %d, from ", len);
-    DEBUG.print(remoteIP);
-    DEBUG.printf(", port %d\n", remotePort);
-#endif
-    buffer = (char *)malloc(len+1);
-    udp.read(buffer, len);
-    buffer[len] = 0;
-
-    ProcessPacket(buffer);
-    free(buffer);
-    buffer = 0;
+  // Datagrams are received and parsed by SSDPClass, and passed to ProcessMessage()
+  SSDP.periodic();
+  fetcher.periodic();
 
-    len = udp.parsePacket();
+  if ((long)(millis() - ticktime) >= 0) {
+    ticktime += 1000;
+    if ((long)(millis() - ticktime) >= 0)
+      ticktime = millis() + 1000;	// Don't try to catch up after a long stall
+    Tick();
   }
 
 #ifdef DEBUG
@@ -214,168 +255,429 @@ void DiscoveryManager::periodic() {
     last = newtime;
   if (newtime - last > 60 && cnt-- >= 0) {
     last = newtime;
-    if (maxdevices == 0)
+    if (ndevices == 0)
       Serial.println("No devices");
     else
-      for (int i=0; i<maxdevices; i++) 
-        if (devices[i].port) {
+      for (int i=0; i<DISCOVER_MAX_DEVICES; i++) 
+        if (devices[i].hash) {
           if (devices[i].usn)
             Serial.printf("Device %d USN %s \n", i, devices[i].usn);
           else
-            Serial.printf("Device %d location %s \n", i, devices[i].location);
+            Serial.printf("Device %d location %s \n", i,
+	      devices[i].location ? devices[i].location : "?");
           Serial.printf("  %u.%u.%u.%u %d %s\n",
 	    devices[i].ip[0], devices[i].ip[1], devices[i].ip[2], devices[i].ip[3],
 	    devices[i].port,
-	    devices[i].friendlyname);
+	    devices[i].friendlyname ? devices[i].friendlyname : "");
         }
   }
 #endif
 }
 
-// These are the headers detected by the code.
-// Comment them out if we don't need them, will speed up the code.
-struct {
-  const char *header;
-  char *found;
-  int length;
-} headers [] = {
-#define HEADER_M_SEARCH 0
-  { "M-SEARCH", 0, 0},
-#define HEADER_NOTIFY 1
-  { "NOTIFY", 0, 0},
-#define HEADER_HTTP_1_1 2
-  { "HTTP/1.1 200 OK", 0, 0},
-#define HEADER_MAN 3
-  { "MAN:", 0, 0 },
-#define HEADER_EXT 4
-  { "EXT:", 0, 0 },
-#define HEADER_MX 5
-  { "MX:", 0, 0 },
-#define HEADER_ST 6
-  { "ST:", 0, 0 },
-#define HEADER_USN 7
-  { "USN:", 0, 0 },
-#define HEADER_NTS 8
-  { "NTS:", 0, 0 },
-#define HEADER_LOCATION 9
-  { "LOCATION:", 0, 0 },
-#define HEADER_SERVER 10
-  { "SERVER:", 0, 0 },
-//{ "HOST:", 0, 0 },		// This is not interesting information
-  { 0, 0, 0 }
-};
-
-void DiscoveryManager::ProcessPacket(char *packet) {
-  // Per packet : initialize "found" marks to NULL
-  for (int i=0; headers[i].header; i++) {
-      headers[i].found = 0;
-
-      // Happens only once : initialize the length field.
-      if (headers[i].length == 0)
-        headers[i].length = strlen(headers[i].header);
-  }
-
-  // Scan the packet, cut into lines, identify headers
-  for (char *p=packet; *p; p++) {
-    if (*p == '\r' || *p == '\n') {
-      *p = 0;
-      char *q = p+1;
+// Called by SSDPClass for each datagram received
+void DiscoveryManager::ProcessMessage(SSDPMessage &msg, uint32_t addr, uint16_t port) {
+  if (msg.type == SSDP_MSG_MSEARCH)
+    return;	// Other control points searching
 
-      for (int i=0; headers[i].header; i++)
-        if (strncmp(q, headers[i].header, headers[i].length) == 0)
-	  headers[i].found = q;
-    }
-  }
+  if (msg.value[SSDP_HDR_USN]) {
+    const char *usn = msg.value[SSDP_HDR_USN];
 
-  if (headers[HEADER_USN].found) {
-    char *usn = headers[HEADER_USN].found + headers[HEADER_USN].length;
-
-    // Skip initial blanks
-    while (*usn && *usn == ' ') usn++;
     if (strncmp(usn, "uuid:", 5) == 0) {
-      char *uuid = usn + 5;
+      const char *uuid = usn + 5;
       if (*uuid == ' ')
         ++uuid;		// Skip one space
 
       if (strncmp(uuid, sensor_uuid_prefix, strlen(sensor_uuid_prefix)) == 0) {
-        AddDevice();
+        const char *nts = msg.value[SSDP_HDR_NTS];
+        if (msg.type == SSDP_MSG_NOTIFY && nts && strcmp(nts, "ssdp:byebye") == 0)
+          RemoveDevice(FindDevice(usn));
+        else
+          AddDevice(msg, addr, port);
       } else {
 #if 0
         Serial.print("Ignoring device 1 .. ");
-        Serial.println(headers[HEADER_USN].found);
+        Serial.println(msg.value[SSDP_HDR_USN]);
 #endif
       }
     } else {
 #if 0
       Serial.print("Ignoring device 2 .. ");
-      Serial.println(headers[HEADER_USN].found);
+      Serial.println(msg.value[SSDP_HDR_USN]);
 #endif
     }
   } else {
 #if 0
     Serial.print("Ignoring device 3 .. ");
-    Serial.println(headers[HEADER_USN].found);
+    Serial.println(msg.value[SSDP_HDR_USN]);
 #endif
   }
 #if 0
-  if (headers[HEADER_LOCATION].found)
-    Serial.printf("ProcessPacket(%s)\n", headers[HEADER_LOCATION].found + headers[HEADER_LOCATION].length);
+  if (msg.value[SSDP_HDR_LOCATION])
+    Serial.printf("ProcessPacket(%s)\n", msg.value[SSDP_HDR_LOCATION]);
 #endif
 }
 
-// Add a devices, if not already present, based on content of "headers"
-void DiscoveryManager::AddDevice() {
-  // Look it up
-  for (int i=0; i<maxdevices; i++)
-    if (devices[i].usn && strcmp(devices[i].usn, headers[HEADER_USN].found + headers[HEADER_USN].length) == 0) {
-      Serial.printf("DM: duplicate (%u.%u.%u.%u)\n",
-	devices[i].ip[0], devices[i].ip[1], devices[i].ip[2], devices[i].ip[3]);
+/*
+ * 64 bit FNV-1a hash of the device UUID : the USN up to "::".
+ * A device sends a USN per target (rootdevice, device type, services), it's still one device.
+ */
+uint64_t DiscoveryManager::Hash(const char *usn) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = usn; *p && !(p[0] == ':' && p[1] == ':'); p++) {
+    h ^= (uint8_t)*p;
+    h *= 0x100000001b3ULL;
+  }
+  return h ? h : 1;	// 0 marks a free entry
+}
+
+// Returns the link that points to the device with this hash (or the -1 at the end of the chain)
+int8_t *DiscoveryManager::Lookup(uint64_t hash) {
+  int8_t *link = &buckets[hash & (DISCOVER_BUCKETS - 1)];
+  while (*link >= 0 && devices[*link].hash != hash)
+    link = &devices[*link].next;
+  return link;
+}
+
+// What the device's description says it offers, NULL if we don't know (yet)
+struct DeviceCapabilities *DiscoveryManager::getCapabilities(struct DiscoveredDevice *dev) {
+  if (dev == NULL)
+    return NULL;
+  struct DeviceCapabilities *caps = fetcher.Find(dev->hash);
+  if (caps && caps->state == DESCRIPTION_DONE && caps->bootid == dev->bootid)
+    return caps;
+  return NULL;
+}
+
+// The description came in : prefer its friendlyName over the SERVER string
+void DiscoveryManager::DescriptionFetched(struct DeviceCapabilities *caps) {
+  int8_t *link = Lookup(caps->hash);
+  if (*link < 0)
+    return;		// Gone in the mean time
+  struct DiscoveredDevice *dev = &devices[*link];
+
+  if (caps->friendlyName) {
+    Release(dev->friendlyname);
+    dev->friendlyname = Intern(caps->friendlyName);
+  }
+  if (callback)
+    callback(dev, DISCOVERY_UPDATED);
+}
+
+struct DiscoveredDevice *DiscoveryManager::FindDevice(const char *usn) {
+  if (usn == NULL)
+    return NULL;
+  int8_t ix = *Lookup(Hash(usn));
+  return (ix < 0) ? NULL : &devices[ix];
+}
+
+void DiscoveryManager::onDevice(DiscoveryCallback cb) {
+  callback = cb;
+}
+
+/*
+ * A device announces itself (NT) or answers (ST) with several types, in no particular
+ * order : upnp:rootdevice, its uuid, its device type and its service types.
+ * The device type tells most about it.
+ */
+static int TypeRank(const char *type) {
+  if (strncmp(type, "urn:", 4) != 0)
+    return 0;
+  if (strstr(type, ":device:"))
+    return 2;
+  return 1;
+}
+
+// Add a device, or refresh it if already present, based on the headers in the message
+void DiscoveryManager::AddDevice(SSDPMessage &msg, uint32_t addr, uint16_t port) {
+  const char *usn = msg.value[SSDP_HDR_USN];
+  uint64_t hash = Hash(usn);
+  int8_t *link = Lookup(hash);
+  DiscoveredDevice *dev;
+  enum DiscoveryEvent ev;
+
+  if (*link >= 0) {
+    dev = &devices[*link];
+    ev = DISCOVERY_UPDATED;
+  } else {
+    if (freelist < 0) {
+#ifdef DEBUG
+      DEBUG.println("DM: device table full");
+#endif
       return;
     }
+    int8_t ix = freelist;
+    dev = &devices[ix];
+    freelist = dev->next;
+    dev->next = -1;
+    *link = ix;
+
+    dev->hash = hash;
+    dev->usn = Intern(usn);
+    dev->location = dev->upnptype = dev->friendlyname = NULL;
+    dev->port = 0;
+    dev->bootid = 0;
+    dev->presence = PRESENCE_ALIVE;
+    dev->wprev = dev->wnext = -1;
+    dev->wslot = 0;
+    ndevices++;
+    ev = DISCOVERY_ADDED;
+  }
+
+  // Refresh its lifetime
+  int maxage = DISCOVER_DEFAULT_MAX_AGE;
+  const char *cc = msg.value[SSDP_HDR_CACHE_CONTROL];
+  const char *p = cc ? strstr(cc, "max-age") : NULL;
+  if (p && (p = strchr(p, '=')) != NULL)
+    maxage = atoi(p+1);
+  dev->expires = millis() + maxage * 1000UL;
+  Schedule(dev, PRESENCE_INTERVAL);	// Or sooner, if it expires before
+
+  // Copy the data, only tell the world if something changed
+  bool changed = (ev == DISCOVERY_ADDED) || (uint32_t)dev->ip != addr || dev->port != port;
+  if (Seen(dev))
+    changed = true;	// It's back
+  dev->ip = addr;
+  dev->port = port;
+
+  const char *location = msg.value[SSDP_HDR_LOCATION];
+  if (location && (dev->location == NULL || strcmp(dev->location, location) != 0)) {
+    Release(dev->location);
+    dev->location = Intern(location);
+    changed = true;
+  }
+  const char *type = msg.value[(msg.type == SSDP_MSG_NOTIFY) ? SSDP_HDR_NT : SSDP_HDR_ST];
+  if (type && (dev->upnptype == NULL || TypeRank(type) > TypeRank(dev->upnptype))) {
+    Release(dev->upnptype);
+    dev->upnptype = Intern(type);
+    changed = true;
+  }
+  const char *server = msg.value[SSDP_HDR_SERVER];
+  if (server && dev->friendlyname == NULL)
+    dev->friendlyname = Intern(server);
+
+  // A new BOOTID.UPNP.ORG means the device rebooted, its description may have changed
+  const char *b = msg.value[SSDP_HDR_BOOTID];
+  uint32_t bootid = b ? strtoul(b, NULL, 10) : 0;
+  if (bootid != dev->bootid) {
+    dev->bootid = bootid;
+    changed = true;
+  }
+  if (changed)
+    fetcher.Request(dev->hash, dev->bootid, dev->location);
 
-  // Need to allocation an additional entry
-  if (ndevices == maxdevices) {
-    maxdevices += DISCOVER_DEVICES_INCREMENT;
-    devices = (struct DiscoveredDevice *)realloc((void *)devices, maxdevices * sizeof(struct DiscoveredDevice));
-
-    for (int i=ndevices; i<maxdevices; i++) {
-      devices[i].location = NULL;
-      devices[i].friendlyname = NULL;
-      devices[i].usn = NULL;
-      devices[i].upnptype = NULL;
-      devices[i].ip = IPAddress(0,0,0,0);
-      devices[i].port = 0;
+  if (ev == DISCOVERY_ADDED && latency == 0 && expected && ndevices >= expected) {
+    latency = millis() - searchstart;
+#ifdef DEBUG
+    DEBUG.printf("DM: %d devices found in %lu ms\n", ndevices, latency);
+#endif
+  }
+
+  if (! changed)
+    return;
+
+#ifdef DEBUG
+  DEBUG.printf("DM %s [%d] : ", (ev == DISCOVERY_ADDED) ? "new" : "update", dev - devices);
+  DEBUG.println(IPAddress(addr));
+#endif
+  if (callback)
+    callback(dev, ev);
+}
+
+void DiscoveryManager::RemoveDevice(struct DiscoveredDevice *dev) {
+  if (dev == NULL)
+    return;
+
+#ifdef DEBUG
+  DEBUG.printf("DM remove [%d] : ", dev - devices);
+  DEBUG.println(dev->ip);
+#endif
+  if (callback)
+    callback(dev, DISCOVERY_REMOVED);
+
+  Unschedule(dev);
+
+  // Unlink from its hash chain, put on the free list
+  int8_t *link = Lookup(dev->hash);
+  int8_t ix = *link;
+  *link = dev->next;
+  dev->next = freelist;
+  freelist = ix;
+
+  dev->hash = 0;
+  Release(dev->usn);
+  Release(dev->location);
+  Release(dev->upnptype);
+  Release(dev->friendlyname);
+  dev->usn = dev->location = dev->upnptype = dev->friendlyname = NULL;
+  ndevices--;
+
+  // Look for it (or its replacement) more actively
+  backoff = DISCOVERY_SEARCH_MIN;
+}
+
+/*
+ * Once per second : look at the devices whose time has come.
+ * Expiry (max-age) is noticed here too, see Schedule().
+ */
+void DiscoveryManager::Tick() {
+  wheelpos = (wheelpos + 1) % PRESENCE_WHEEL_SLOTS;
+  int8_t ix = wheel[wheelpos];
+  wheel[wheelpos] = -1;
+  while (ix >= 0) {
+    struct DiscoveredDevice *dev = &devices[ix];
+    ix = dev->wnext;
+    dev->wprev = dev->wnext = -1;
+    Check(dev);
+  }
+}
+
+void DiscoveryManager::Check(struct DiscoveredDevice *dev) {
+  if ((long)(millis() - dev->expires) >= 0) {
+    RemoveDevice(dev);
+    return;
+  }
+
+  unsigned long quiet = millis() - dev->lastseen;
+  if (quiet < PRESENCE_INTERVAL * 1000UL) {
+    Schedule(dev, PRESENCE_INTERVAL - quiet / 1000);
+    return;
+  }
+
+  if (dev->probes >= PRESENCE_MAX_PROBES) {
+    if (dev->presence != PRESENCE_LOST) {
+      dev->presence = PRESENCE_LOST;
+#ifdef DEBUG
+      DEBUG.printf("DM lost [%d] : ", dev - devices);
+      DEBUG.println(dev->ip);
+#endif
+      if (callback)
+        callback(dev, DISCOVERY_LOST);
     }
+    Probe(dev);		// Keep asking, slowly
+    Schedule(dev, PRESENCE_INTERVAL);
+    return;
   }
 
-  // Look for an empty spot in the array
-  int i;
-  for (i=0; i<maxdevices; i++)
-    if (devices[i].port == 0)	// Because 0 is not a working port number
-      break;
-
-  // copy the data
-  devices[i].ip = udp.remoteIP();
-  devices[i].port = udp.remotePort();
-  if (headers[HEADER_USN].found)
-    devices[i].usn = strdup(headers[HEADER_USN].found + headers[HEADER_USN].length);
-  if (headers[HEADER_LOCATION].found)
-    devices[i].location = strdup(headers[HEADER_LOCATION].found + headers[HEADER_LOCATION].length);
-  if (headers[HEADER_ST].found)
-    devices[i].upnptype = strdup(headers[HEADER_ST].found + headers[HEADER_ST].length);
-  if (headers[HEADER_SERVER].found)
-    devices[i].friendlyname = strdup(headers[HEADER_SERVER].found + headers[HEADER_SERVER].length);
-
-  ndevices++;
+  if (dev->probes > 0)
+    dev->presence = PRESENCE_SUSPECT;
+  dev->probes++;
+  Probe(dev);
+  Schedule(dev, PRESENCE_PROBE_TIMEOUT);
+}
+
+/*
+ * Put the device in the wheel slot that comes up after this many seconds,
+ * or when it expires if that's sooner.
+ */
+void DiscoveryManager::Schedule(struct DiscoveredDevice *dev, int seconds) {
+  long left = (long)(dev->expires - millis());
+  if (left < seconds * 1000L)
+    seconds = (left + 999) / 1000;
+  if (seconds < 1)
+    seconds = 1;
+  if (seconds >= PRESENCE_WHEEL_SLOTS)
+    seconds = PRESENCE_WHEEL_SLOTS - 1;
+
+  Unschedule(dev);
+  int8_t ix = dev - devices;
+  dev->wslot = (wheelpos + seconds) % PRESENCE_WHEEL_SLOTS;
+  dev->wprev = -1;
+  dev->wnext = wheel[dev->wslot];
+  if (dev->wnext >= 0)
+    devices[dev->wnext].wprev = ix;
+  wheel[dev->wslot] = ix;
+}
+
+void DiscoveryManager::Unschedule(struct DiscoveredDevice *dev) {
+  int8_t ix = dev - devices;
+  if (dev->wprev >= 0)
+    devices[dev->wprev].wnext = dev->wnext;
+  else if (wheel[dev->wslot] == ix)
+    wheel[dev->wslot] = dev->wnext;
+  else
+    return;		// Not in the wheel
+  if (dev->wnext >= 0)
+    devices[dev->wnext].wprev = dev->wprev;
+  dev->wprev = dev->wnext = -1;
+}
+
+/*
+ * We heard from the device. No need to touch the wheel : when its slot comes up,
+ * Check() notices and puts it back further on. Returns true if it had been lost.
+ */
+bool DiscoveryManager::Seen(struct DiscoveredDevice *dev) {
+  dev->lastseen = millis();
+  dev->probes = 0;
+  bool back = (dev->presence == PRESENCE_LOST);
+  dev->presence = PRESENCE_ALIVE;
+  return back;
+}
+
+// Ask the device directly whether it's still there, the reply goes through AddDevice()
+void DiscoveryManager::Probe(struct DiscoveredDevice *dev) {
+  if (dev->usn == NULL)
+    return;		// Not interned (table full), it'll expire instead
+  char packet[200];
+  const char *end = strstr(dev->usn, "::");
+  int ulen = end ? (end - dev->usn) : strlen(dev->usn);
+  int len = snprintf(packet, sizeof(packet), searchUnicastSSDPtemplate,
+    dev->ip.toString().c_str(), dev->port, ulen, dev->usn);
+  if (len < sizeof(packet))
+    SSDP.unicast(packet, len, dev->ip, dev->port);
+}
+
+/*
+ * Something else (e.g. an event) came from this address : the device is alive.
+ */
+void DiscoveryManager::Heard(uint32_t addr) {
+  for (int i=0; i<DISCOVER_MAX_DEVICES; i++)
+    if (devices[i].hash && (uint32_t)devices[i].ip == addr && Seen(&devices[i]) && callback)
+      callback(&devices[i], DISCOVERY_UPDATED);
+}
+
+/*
+ * Keep one copy of each string, shared by all devices that use it.
+ * Returns NULL if the table is full.
+ */
+const char *DiscoveryManager::Intern(const char *s) {
+  if (s == NULL)
+    return NULL;
+
+  uint32_t h = 2166136261U;
+  for (const char *p = s; *p; p++)
+    h = (h ^ (uint8_t)*p) * 16777619U;
+
+  int empty = -1;
+  for (int i=0; i<DISCOVER_MAX_STRINGS; i++)
+    if (strings[i].refs == 0) {
+      if (empty < 0)
+        empty = i;
+    } else if (strings[i].hash == h && strcmp(strings[i].s, s) == 0) {
+      strings[i].refs++;
+      return strings[i].s;
+    }
 
+  if (empty < 0) {
 #ifdef DEBUG
-  DEBUG.print("DM new [");
-  DEBUG.print(i);
-  DEBUG.print("] : ");
-  DEBUG.println(udp.remoteIP());
+    DEBUG.println("DM: string table full");
 #endif
+    return NULL;
+  }
+  strings[empty].hash = h;
+  strings[empty].refs = 1;
+  strings[empty].s = strdup(s);
+  return strings[empty].s;
 }
 
-// FIXME
-void DiscoveryManager::RemoveDevice() {
+void DiscoveryManager::Release(const char *s) {
+  if (s == NULL)
+    return;
+  for (int i=0; i<DISCOVER_MAX_STRINGS; i++)
+    if (strings[i].refs && strings[i].s == s) {
+      if (--strings[i].refs == 0) {
+        free(strings[i].s);
+        strings[i].s = NULL;
+      }
+      return;
+    }
 }
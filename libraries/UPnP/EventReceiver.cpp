@@ -0,0 +1,512 @@
+/*
+ * Receive events (GENA NOTIFY) from the devices a controller subscribed to.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+
+#include "UPnP/EventReceiver.h"
+#include "UPnP/WebServer.h"
+#include "UPnP/WebClient.h"
+#include "UPnP/Headers.h"
+#include "UPnP.h"
+
+// #undef DEBUG
+#define DEBUG Serial
+
+extern WebServer HTTP;
+
+static const char *_notify_path = "/notify";
+
+static const char *_subscribe_template =
+  "SUBSCRIBE %s HTTP/1.1\r\n"
+  "HOST: %s:%d\r\n"
+  "CALLBACK: <http://%s:%d%s>\r\n"
+  "NT: upnp:event\r\n"
+  "TIMEOUT: Second-%d\r\n"
+  "CONNECTION: close\r\n"
+  "\r\n";
+
+static const char *_renew_template =
+  "SUBSCRIBE %s HTTP/1.1\r\n"
+  "HOST: %s:%d\r\n"
+  "SID: %s\r\n"
+  "TIMEOUT: Second-%d\r\n"
+  "CONNECTION: close\r\n"
+  "\r\n";
+
+static const char *_unsubscribe_template =
+  "UNSUBSCRIBE %s HTTP/1.1\r\n"
+  "HOST: %s:%d\r\n"
+  "SID: %s\r\n"
+  "CONNECTION: close\r\n"
+  "\r\n";
+
+EventReceiver::EventReceiver() {
+  for (int i=0; i<EVENT_MAX_SUBSCRIPTIONS; i++) {
+    subs[i].url = subs[i].sid = NULL;
+    subs[i].hash = 0;
+  }
+  for (int i=0; i<EVENT_BUCKETS; i++)
+    buckets[i] = -1;
+  for (int i=0; i<EVENT_MAX_CONNECTIONS; i++) {
+    exchanges[i].kind = EVENT_REQUEST_NONE;
+    exchanges[i].sub = NULL;
+    exchanges[i].oldsid = NULL;
+  }
+  port = 80;
+  callback = NULL;
+}
+
+EventReceiver::~EventReceiver() {
+  for (int i=0; i<EVENT_MAX_SUBSCRIPTIONS; i++)
+    if (subs[i].url)
+      Unsubscribe(&subs[i]);
+}
+
+// Port is the one our WebServer listens on, it is part of the CALLBACK we hand out
+void EventReceiver::begin(uint16_t port) {
+  this->port = port;
+  HTTP.on(_notify_path, HTTP_NOTIFY, std::bind(&EventReceiver::NotifyHandler, this));
+}
+
+void EventReceiver::onEvent(EventCallback cb) {
+  callback = cb;
+}
+
+/*
+ * Start receiving events from this eventSubURL. The SUBSCRIBE goes out from periodic().
+ */
+struct EventSubscription *EventReceiver::Subscribe(const char *url) {
+  struct EventSubscription *sub = NULL;
+  for (int i=0; i<EVENT_MAX_SUBSCRIPTIONS; i++)
+    if (subs[i].url && strcmp(subs[i].url, url) == 0)
+      return &subs[i];
+    else if (subs[i].url == NULL && sub == NULL)
+      sub = &subs[i];
+  if (sub == NULL)
+    return NULL;
+
+  sub->url = strdup(url);
+  sub->sid = NULL;
+  sub->hash = 0;
+  sub->next = -1;
+  sub->seq = 0;
+  sub->gaps = 0;
+  sub->resync = false;
+  sub->busy = false;
+  sub->renew = millis();
+  sub->nvars = 0;
+  return sub;
+}
+
+// Don't tell a device that is gone, that would only wait for a timeout
+void EventReceiver::Unsubscribe(struct EventSubscription *sub, bool tell) {
+  if (sub == NULL || sub->url == NULL)
+    return;
+
+  // A reply still on its way is of no use anymore
+  for (int i=0; i<EVENT_MAX_CONNECTIONS; i++)
+    if (exchanges[i].sub == sub)
+      exchanges[i].sub = NULL;
+
+  struct Exchange *x = FreeExchange();
+  if (sub->sid && tell && x)
+    Start(x, NULL, EVENT_REQUEST_UNSUBSCRIBE, sub->url, sub->sid);
+  Unlink(sub);
+  free(sub->url);
+  sub->url = NULL;
+}
+
+struct EventSubscription *EventReceiver::FindSubscription(const char *url) {
+  for (int i=0; i<EVENT_MAX_SUBSCRIPTIONS; i++)
+    if (subs[i].url && strcmp(subs[i].url, url) == 0)
+      return &subs[i];
+  return NULL;
+}
+
+// Subscriptions keep their slot for as long as they exist
+int EventReceiver::Index(struct EventSubscription *sub) {
+  return sub - subs;
+}
+
+// NULL if slot i is not in use
+struct EventSubscription *EventReceiver::getSubscription(int i) {
+  if (i < 0 || i >= EVENT_MAX_SUBSCRIPTIONS || subs[i].url == NULL)
+    return NULL;
+  return &subs[i];
+}
+
+const char *EventReceiver::getValue(struct EventSubscription *sub, const char *name) {
+  for (int i=0; i<sub->nvars; i++)
+    if (strcmp(sub->vars[i].name, name) == 0)
+      return sub->vars[i].value;
+  return NULL;
+}
+
+/*
+ * Call this from the main loop : look at replies that came in, and start at most
+ * one new request per call. Subscriptions are renewed with their SID, so no events
+ * are lost. After missed events we get a fresh subscription (its initial event has
+ * all values), and only then drop the old one.
+ */
+void EventReceiver::periodic() {
+  Poll();
+
+  struct Exchange *x = FreeExchange();
+  if (x == NULL)
+    return;
+  for (int i=0; i<EVENT_MAX_SUBSCRIPTIONS; i++) {
+    struct EventSubscription *sub = &subs[i];
+    if (sub->url == NULL || sub->busy || (long)(millis() - sub->renew) < 0)
+      continue;
+
+    uint8_t kind = (sub->sid && ! sub->resync) ? EVENT_REQUEST_RENEW : EVENT_REQUEST_SUBSCRIBE;
+    if (Start(x, sub, kind, sub->url, sub->sid))
+      sub->busy = true;
+    else
+      sub->renew = millis() + EVENT_RETRY;
+    return;
+  }
+}
+
+struct EventReceiver::Exchange *EventReceiver::FreeExchange() {
+  for (int i=0; i<EVENT_MAX_CONNECTIONS; i++)
+    if (exchanges[i].kind == EVENT_REQUEST_NONE)
+      return &exchanges[i];
+  return NULL;
+}
+
+/*
+ * Send the request, don't wait for the reply.
+ * Note : connecting is not asynchronous in this core, but on a LAN it's quick.
+ */
+bool EventReceiver::Start(struct Exchange *x, struct EventSubscription *sub, uint8_t kind,
+    const char *url, const char *sid) {
+  char host[40];
+  const char *path;
+  uint16_t dport;
+  IPAddress ip;
+  if (! WebClient::parseURL(url, host, sizeof(host), dport, path))
+    return false;
+  if (! WebClient::resolve(host, ip))
+    return false;
+  if (! x->client.connect(ip, dport))
+    return false;
+
+  switch (kind) {
+  case EVENT_REQUEST_SUBSCRIBE:
+    x->client.printf(_subscribe_template, path, host, dport,
+      WiFi.localIP().toString().c_str(), port, _notify_path, EVENT_SUBSCRIBE_TIMEOUT);
+    break;
+  case EVENT_REQUEST_RENEW:
+    x->client.printf(_renew_template, path, host, dport, sid, EVENT_SUBSCRIBE_TIMEOUT);
+    break;
+  case EVENT_REQUEST_UNSUBSCRIBE:
+    x->client.printf(_unsubscribe_template, path, host, dport, sid);
+    break;
+  }
+
+  x->sub = sub;
+  x->kind = kind;
+  x->linked = false;
+  x->deadline = millis() + EVENT_REPLY_TIMEOUT;
+  x->status = 0;
+  x->timeout = 0;
+  x->linelen = 0;
+  return true;
+}
+
+// Read what came in for the requests in progress
+void EventReceiver::Poll() {
+  for (int i=0; i<EVENT_MAX_CONNECTIONS; i++) {
+    struct Exchange *x = &exchanges[i];
+    if (x->kind == EVENT_REQUEST_NONE)
+      continue;
+
+    char buf[64];
+    int n;
+    while ((n = x->client.available()) > 0) {
+      n = x->client.read((uint8_t *)buf, (n > sizeof(buf)) ? sizeof(buf) : n);
+      if (n <= 0)
+        break;
+      for (int j=0; j<n; j++)
+        if (buf[j] == '\n') {
+          x->line[x->linelen] = 0;
+          Line(x);
+          x->linelen = 0;
+        } else if (buf[j] != '\r' && x->linelen < sizeof(x->line) - 1)
+          x->line[x->linelen++] = buf[j];
+    }
+
+    if (! x->client.connected() || (long)(millis() - x->deadline) >= 0)
+      Finish(x);
+  }
+}
+
+/*
+ * One line of the reply. The SID and TIMEOUT may be headers, or
+ * (devices in this tree, before they sent headers) lines in the body.
+ */
+void EventReceiver::Line(struct Exchange *x) {
+  const char *line = x->line;
+  if (x->status == 0) {
+    const char *p = strchr(line, ' ');
+    if (strncmp(line, "HTTP/", 5) == 0 && p)
+      x->status = atoi(p + 1);
+    return;
+  }
+
+  if (strncasecmp(line, "TIMEOUT:", 8) == 0) {
+    const char *p = line + 8;
+    while (*p == ' ')
+      p++;
+    if (strncasecmp(p, "Second-", 7) == 0)
+      x->timeout = atoi(p + 7);
+    return;
+  }
+
+  // Use a new SID right away : the initial event may be here before the reply is finished
+  if (strncasecmp(line, "SID:", 4) == 0 && x->kind == EVENT_REQUEST_SUBSCRIBE
+      && x->status == 200 && x->sub && ! x->linked) {
+    const char *p = line + 4;
+    while (*p == ' ')
+      p++;
+    if (*p == 0 || strlen(p) >= EVENT_SID_LENGTH)
+      return;
+    free(x->oldsid);
+    x->oldsid = x->sub->sid ? strdup(x->sub->sid) : NULL;
+    Link(x->sub, p);
+    x->linked = true;
+  }
+}
+
+void EventReceiver::Finish(struct Exchange *x) {
+  struct EventSubscription *sub = x->sub;
+  uint8_t kind = x->kind;
+  bool ok = (x->status == 200);
+  int granted = (x->timeout > 0) ? x->timeout : EVENT_SUBSCRIBE_TIMEOUT;
+  char *oldsid = x->oldsid;
+
+  x->client.stop();
+  x->kind = EVENT_REQUEST_NONE;
+  x->sub = NULL;
+  x->oldsid = NULL;
+
+#ifdef DEBUG
+  DEBUG.printf("EventReceiver : request %d %s -> %d\n", kind,
+    sub ? sub->url : "", x->status);
+#endif
+  if (sub == NULL) {
+    free(oldsid);
+    return;		// UNSUBSCRIBE, or the subscription went away meanwhile
+  }
+  sub->busy = false;
+
+  switch (kind) {
+  case EVENT_REQUEST_SUBSCRIBE:
+    if (x->linked) {
+      sub->resync = false;
+      sub->renew = millis() + granted * 1000UL / 2;
+      // Best effort : the old subscription expires anyway
+      if (oldsid)
+        Start(x, NULL, EVENT_REQUEST_UNSUBSCRIBE, sub->url, oldsid);
+    } else
+      sub->renew = millis() + EVENT_RETRY;
+    break;
+
+  case EVENT_REQUEST_RENEW:
+    if (ok)
+      sub->renew = millis() + granted * 1000UL / 2;
+    else {
+      // 412 : the device doesn't know us anymore (e.g. it rebooted). Start over.
+      sub->resync = true;
+      sub->renew = (x->status == 412) ? millis() : millis() + EVENT_RETRY;
+    }
+    break;
+  }
+  free(oldsid);
+}
+
+// FNV-1a
+uint32_t EventReceiver::Hash(const char *sid) {
+  uint32_t h = 0x811c9dc5;
+  for (const char *p = sid; *p; p++) {
+    h ^= (uint8_t)*p;
+    h *= 0x01000193;
+  }
+  return h ? h : 1;	// 0 marks an entry without SID
+}
+
+// Returns the link that points to the subscription with this hash (or the -1 at the end of the chain)
+int8_t *EventReceiver::Lookup(uint32_t hash) {
+  int8_t *link = &buckets[hash & (EVENT_BUCKETS - 1)];
+  while (*link >= 0 && subs[*link].hash != hash)
+    link = &subs[*link].next;
+  return link;
+}
+
+void EventReceiver::Link(struct EventSubscription *sub, const char *sid) {
+  Unlink(sub);
+  sub->sid = strdup(sid);
+  sub->hash = Hash(sid);
+  int8_t *link = Lookup(sub->hash);
+  sub->next = *link;		// -1, unless two SIDs share a hash
+  *link = sub - subs;
+  sub->seq = 0;			// The initial event comes next
+}
+
+void EventReceiver::Unlink(struct EventSubscription *sub) {
+  if (sub->hash) {
+    int8_t *link = &buckets[sub->hash & (EVENT_BUCKETS - 1)];
+    while (*link >= 0 && &subs[*link] != sub)
+      link = &subs[*link].next;
+    if (*link >= 0)
+      *link = sub->next;
+  }
+  free(sub->sid);
+  sub->sid = NULL;
+  sub->hash = 0;
+  sub->next = -1;
+}
+
+/*
+ * NOTIFY delivery path HTTP/1.1
+ * SID: uuid:subscription-UUID
+ * SEQ: event key
+ *
+ * <e:propertyset xmlns:e="urn:schemas-upnp-org:event-1-0">
+ * <e:property><variableName>new value</variableName></e:property>
+ * </e:propertyset>
+ *
+ * The body is tokenized in place : names and values are terminated where they are.
+ */
+void EventReceiver::NotifyHandler() {
+  const char *sid = upnp_headers[UPNP_METHOD_SID];
+  struct EventSubscription *sub = FindSID(sid);
+  if (sub == NULL) {
+    Poll();		// Maybe the reply to our SUBSCRIBE is in, but not read yet
+    sub = FindSID(sid);
+  }
+  if (sub == NULL) {
+    HTTP.send(412, UPnPClass::mimeTypeText, "");
+    return;
+  }
+
+  int len = -1;
+  char *body;
+  if (upnp_headers[UPNP_METHOD_CONTENTLENGTH])
+    len = atoi(upnp_headers[UPNP_METHOD_CONTENTLENGTH]);
+  if (len >= 0) {
+    body = (char *)malloc(len + 1);
+    len = HTTP.client().readBytes(body, len);
+    body[len] = 0;
+  } else
+    HTTP.ReadData(len, body);
+
+  // Answer first, the device is waiting for this
+  HTTP.send(200, UPnPClass::mimeTypeText, "");
+
+  // SEQ 0 is the initial event of a new subscription
+  uint32_t seq = upnp_headers[UPNP_METHOD_SEQ] ? strtoul(upnp_headers[UPNP_METHOD_SEQ], NULL, 10) : 0;
+  if (seq != 0 && seq != sub->seq) {
+    sub->gaps++;
+    sub->resync = true;		// Get all values again, see periodic()
+    sub->renew = millis();
+#ifdef DEBUG
+    DEBUG.printf("EventReceiver : %s SEQ %u, expected %u\n", sub->sid, seq, sub->seq);
+#endif
+  }
+  sub->seq = seq + 1;
+
+  // Variables are the elements inside e:property
+  int depth = 0;
+  char *name = NULL, *text = NULL;
+  char *p = body;
+  while ((p = strchr(p, '<')) != NULL) {
+    char *tag = p + 1;
+    char *end = strchr(tag, '>');
+    if (end == NULL)
+      break;
+
+    if (*tag == '?' || *tag == '!') {
+      ;
+    } else if (*tag == '/') {
+      if (depth == 3 && name) {
+        *p = 0;
+        Update(sub, name, text);
+        name = NULL;
+      }
+      depth--;
+    } else if (end[-1] == '/') {
+      if (depth == 2) {
+        end[-1] = 0;
+        char *s = strchr(tag, ' ');
+        if (s)
+          *s = 0;
+        Update(sub, tag, "");
+      }
+    } else if (++depth == 3) {
+      *end = 0;
+      char *s = strchr(tag, ' ');
+      if (s)
+        *s = 0;
+      name = tag;
+      text = end + 1;
+    }
+    p = end + 1;
+  }
+  free(body);
+}
+
+struct EventSubscription *EventReceiver::FindSID(const char *sid) {
+  if (sid == NULL)
+    return NULL;
+  int8_t *link = Lookup(Hash(sid));
+  while (*link >= 0 && strcmp(subs[*link].sid, sid) != 0)
+    link = &subs[*link].next;
+  return (*link >= 0) ? &subs[*link] : NULL;
+}
+
+void EventReceiver::Update(struct EventSubscription *sub, const char *name, const char *value) {
+  struct EventVariable *v = NULL;
+  for (int i=0; i<sub->nvars && v == NULL; i++)
+    if (strcmp(sub->vars[i].name, name) == 0)
+      v = &sub->vars[i];
+  if (v == NULL && sub->nvars < EVENT_MAX_VARS) {
+    v = &sub->vars[sub->nvars++];
+    strncpy(v->name, name, EVENT_VAR_NAME_LENGTH - 1);
+    v->name[EVENT_VAR_NAME_LENGTH - 1] = 0;
+  }
+  if (v) {
+    if (strlen(value) < STATEVAR_VALUE_LENGTH)
+      strcpy(v->value, value);
+    else {
+      v->value[0] = 0;	// Don't keep a value that was cut short
+#ifdef DEBUG
+      DEBUG.printf("EventReceiver : value of %s too long (%d)\n", name, strlen(value));
+#endif
+    }
+  }
+
+  if (callback)
+    callback(sub, name, value);
+}
@@ -0,0 +1,338 @@
+/*
+ * Gateway : one node that watches all sensors, so clients don't have to.
+ *
+ * Sensors found by the DiscoveryManager are subscribed to once, their variables
+ * are kept here. Clients can get all of them with one getAll query, or subscribe
+ * to this service : each sensor's main variable (the first it reports) is passed
+ * on as a variable of this service.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+
+#include "UPnP.h"
+#include "UPnP/UPnPService.h"
+#include "UPnP/GatewayService.h"
+#include "UPnP/WebServer.h"
+#include "UPnP/WebClient.h"
+
+extern WebServer HTTP;
+
+#define DEBUG Serial
+
+// Printf style template, parameters : serviceType, sensor list
+static const char *gah_template = "<u:getAllResponse xmlns=\"%s\">\r\n<Sensors>%s</Sensors>\r\n</u:getAllResponse>\r\n";
+
+static const char *getAllXML = "<action>"
+  "<name>getAll</name>"
+  "<argumentList>"
+  "<argument>"
+  "<retval/>"
+  "<name>Sensors</name>"
+  "<direction>out</direction>"
+  "</argument>"
+  "</argumentList>"
+  "</action>";
+
+// UPnP stuff
+static const char *myServiceName = "GatewayService";
+static const char *myServiceType = "urn:danny-backx-info:service:gateway:1";
+static const char *myServiceId = "urn:danny-backx-info:serviceId:gateway1";
+// Variables
+static const char *sensorStrings[GATEWAY_MAX_SENSORS] = {
+  "Sensor00", "Sensor01", "Sensor02", "Sensor03", "Sensor04", "Sensor05", "Sensor06", "Sensor07",
+  "Sensor08", "Sensor09", "Sensor10", "Sensor11", "Sensor12", "Sensor13", "Sensor14", "Sensor15"
+};
+// Actions
+static const char *getAllString = "getAll";
+static const char *getStateString = "getState";		// Of the sensors
+// Types
+static const char *stringString = "string";
+
+GatewayService::GatewayService() :
+  UPnPService(myServiceName, myServiceType, myServiceId)
+{
+  addAction(getAllString, static_cast<MemberActionFunction>(&GatewayService::GetAllHandler), getAllXML);
+  for (int i=0; i<GATEWAY_MAX_SENSORS; i++)
+    addStateVariable(sensorStrings[i], stringString, true);
+  dm = NULL;
+  received = served = 0;
+  for (int i=0; i<GATEWAY_MAX_SENSORS; i++) {
+    sensors[i].hash = 0;
+    sensors[i].location = NULL;
+  }
+  querying = false;
+}
+
+GatewayService::~GatewayService() {
+}
+
+/*
+ * Port is the one our WebServer listens on, sensors send their events there.
+ */
+void GatewayService::begin(DiscoveryManager *dm, uint16_t port) {
+  this->dm = dm;
+  UPnPService::begin(NULL);
+  events.begin(port);
+  events.onEvent(std::bind(&GatewayService::SensorEvent, this,
+    std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+  dm->onDevice(std::bind(&GatewayService::DeviceChanged, this,
+    std::placeholders::_1, std::placeholders::_2));
+
+#ifdef DEBUG
+  DEBUG.println("GatewayService::begin");
+#endif
+}
+
+// Call this from the main loop
+void GatewayService::periodic() {
+  events.periodic();
+  soap.periodic();
+}
+
+// Service URLs in a description are usually relative to the device's LOCATION
+char *GatewayService::ServiceURL(const char *location, const char *url) {
+  if (strncmp(url, "http://", 7) == 0)
+    return strdup(url);
+
+  char host[40];
+  uint16_t port;
+  const char *path;
+  if (! WebClient::parseURL(location, host, sizeof(host), port, path))
+    return NULL;
+  char *r = (char *)malloc(strlen(host) + strlen(url) + 16);
+  sprintf(r, "http://%s:%d%s%s", host, port, (url[0] == '/') ? "" : "/", url);
+  return r;
+}
+
+/*
+ * Each device gets a slot (and so a SensorNN variable) when we first know its description,
+ * and keeps it until it is removed. Returns -1 if there's none (and no room, if create).
+ */
+int GatewayService::FindSensor(uint64_t hash, bool create) {
+  int free = -1;
+  for (int i=0; i<GATEWAY_MAX_SENSORS; i++)
+    if (sensors[i].hash == hash)
+      return i;
+    else if (sensors[i].hash == 0 && free < 0)
+      free = i;
+  if (! create || free < 0)
+    return -1;
+
+  sensors[free].hash = hash;
+  sensors[free].location = NULL;
+  for (int j=0; j<DESCRIPTION_MAX_SERVICES; j++)
+    sensors[free].subs[j] = NULL;
+  return free;
+}
+
+int GatewayService::FindSensor(struct EventSubscription *sub) {
+  for (int i=0; i<GATEWAY_MAX_SENSORS; i++)
+    if (sensors[i].hash)
+      for (int j=0; j<DESCRIPTION_MAX_SERVICES; j++)
+        if (sensors[i].subs[j] == sub)
+          return i;
+  return -1;
+}
+
+// Don't tell a device that is gone, see EventReceiver::Unsubscribe
+void GatewayService::RemoveSensor(int ix) {
+  for (int j=0; j<DESCRIPTION_MAX_SERVICES; j++)
+    events.Unsubscribe(sensors[ix].subs[j], false);
+  free(sensors[ix].location);
+  sensors[ix].location = NULL;
+  sensors[ix].hash = 0;
+}
+
+/*
+ * Subscribe to every evented service of a sensor, as soon as we know its description,
+ * and ask it for its state (getState, all our sensors have it) so we don't have to
+ * wait for a change. Queries to all sensors run side by side, see SOAPClient.
+ * Subscribing again to the same URL is harmless.
+ */
+void GatewayService::DeviceChanged(struct DiscoveredDevice *dev, enum DiscoveryEvent ev) {
+  if (ev == DISCOVERY_REMOVED) {
+    int ix = FindSensor(dev->hash, false);
+    if (ix >= 0)
+      RemoveSensor(ix);
+    return;
+  }
+
+  struct DeviceCapabilities *caps = dm->getCapabilities(dev);
+  if (caps == NULL)
+    return;		// Not yet, we'll get an update when the description is in
+
+  int ix = FindSensor(dev->hash, true);
+  if (ix < 0) {
+#ifdef DEBUG
+    DEBUG.printf("GatewayService : no room for %s\n", dev->location ? dev->location : "?");
+#endif
+    return;
+  }
+  struct GatewaySensor *sensor = &sensors[ix];
+  if (dev->location && (sensor->location == NULL || strcmp(sensor->location, dev->location) != 0)) {
+    free(sensor->location);
+    sensor->location = strdup(dev->location);
+  }
+
+  for (int i=0; i<DESCRIPTION_MAX_SERVICES; i++) {
+    struct EventSubscription *sub = NULL;
+    char *url = NULL;
+    if (i < caps->nservices && caps->eventSubURL[i] && dev->location)
+      url = ServiceURL(dev->location, caps->eventSubURL[i]);
+    if (url) {
+      sub = events.Subscribe(url);
+      free(url);
+    }
+    // The device moved, or its description changed
+    if (sensor->subs[i] && sensor->subs[i] != sub)
+      events.Unsubscribe(sensor->subs[i]);
+    sensor->subs[i] = sub;
+
+    url = (sub && caps->controlURL[i]) ? ServiceURL(dev->location, caps->controlURL[i]) : NULL;
+    if (url && caps->services[i] && ev != DISCOVERY_LOST)
+      soap.Invoke(url, caps->services[i], getStateString, NULL,
+        std::bind(&GatewayService::StateQueried, this, sub,
+          std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+    free(url);
+  }
+}
+
+// The out arguments of getState are the same as the variables in events
+void GatewayService::StateQueried(struct EventSubscription *sub, int id, int status, struct SOAPResult *result) {
+  if (status != 200 || result == NULL || sub->url == NULL)
+    return;
+  querying = true;
+  for (int i=0; i<result->nargs; i++)
+    events.Update(sub, result->name[i], result->value[i]);
+  querying = false;
+}
+
+void GatewayService::SensorEvent(struct EventSubscription *sub, const char *name, const char *value) {
+  if (! querying) {
+    received++;
+    dm->Heard(HTTP.client().remoteIP());	// Saves a presence probe
+  }
+
+  // The sensor's variable has the latest change of any of its variables, as name=value
+  int ix = FindSensor(sub);
+  if (ix < 0)
+    return;
+  char v[STATEVAR_VALUE_LENGTH];
+  if (strlen(name) + strlen(value) + 2 > sizeof(v)) {
+#ifdef DEBUG
+    DEBUG.printf("GatewayService : %s=%s too long for %s\n", name, value, sensorStrings[ix]);
+#endif
+    return;
+  }
+  sprintf(v, "%s=%s", name, value);
+  SendNotify(sensorStrings[ix], v);
+}
+
+/*
+ * Escape text for use in XML. With dst NULL, only count.
+ * Returns the length of the result.
+ */
+static int XMLEscape(char *dst, const char *src) {
+  int len = 0;
+  for (const char *p = src; *p; p++) {
+    const char *e = NULL;
+    switch (*p) {
+    case '<':	e = "&lt;"; break;
+    case '>':	e = "&gt;"; break;
+    case '&':	e = "&amp;"; break;
+    case '"':	e = "&quot;"; break;
+    }
+    if (e) {
+      if (dst)
+        strcpy(dst + len, e);
+      len += strlen(e);
+    } else {
+      if (dst)
+        dst[len] = *p;
+      len++;
+    }
+  }
+  if (dst)
+    dst[len] = 0;
+  return len;
+}
+
+/*
+ * One line per sensor : the variable of this service that follows it, its
+ * location, and all the variables we know of (of all its services).
+ *   Sensor00 http://192.168.1.100:80/description.xml State=1
+ * Text from the sensors is escaped, this goes into XML.
+ */
+void GatewayService::GetAllHandler() {
+  served++;
+
+  // Two passes : count, then fill in
+  char *list = NULL;
+  int l = 0;
+  for (int pass=0; pass<2; pass++) {
+    if (pass == 1) {
+      list = (char *)malloc(l + 1);
+      list[0] = 0;
+    }
+    l = 0;
+    for (int i=0; i<GATEWAY_MAX_SENSORS; i++) {
+      struct GatewaySensor *sensor = &sensors[i];
+      if (sensor->hash == 0)
+        continue;
+      l += XMLEscape(list ? list + l : NULL, sensorStrings[i]);
+      if (list) list[l] = ' ';
+      l++;
+      l += XMLEscape(list ? list + l : NULL, sensor->location ? sensor->location : "-");
+      for (int j=0; j<DESCRIPTION_MAX_SERVICES; j++) {
+        struct EventSubscription *sub = sensor->subs[j];
+        if (sub == NULL)
+          continue;
+        for (int k=0; k<sub->nvars; k++) {
+          if (list) list[l] = ' ';
+          l++;
+          l += XMLEscape(list ? list + l : NULL, sub->vars[k].name);
+          if (list) list[l] = '=';
+          l++;
+          l += XMLEscape(list ? list + l : NULL, sub->vars[k].value);
+        }
+      }
+      if (list) strcpy(list + l, "\r\n");
+      l += 2;
+    }
+  }
+
+  int l2 = strlen(gah_template) + strlen(myServiceType) + l,
+      l1 = strlen(UPnPClass::envelopeHeader) + l2 + strlen(UPnPClass::envelopeTrailer) + 5;
+  char *tmp2 = (char *)malloc(l2),
+       *tmp1 = (char *)malloc(l1);
+#ifdef DEBUG
+  DEBUG.printf("GatewayService::GetAllHandler (served %u, received %u)\n", served, received);
+#endif
+  strcpy(tmp1, UPnPClass::envelopeHeader);
+  sprintf(tmp2, gah_template, myServiceType, list);
+  free(list);
+  strcat(tmp1, tmp2);
+  free(tmp2);
+  strcat(tmp1, UPnPClass::envelopeTrailer);
+  HTTP.send(200, UPnPClass::mimeTypeXML, tmp1);
+  free(tmp1);
+}
@@ -59,6 +59,7 @@ void GetTime::begin() {
     new ConfigurationItem("ntp2", "ntp.belnet.be"),
     new ConfigurationItem("timezone", 1),
     NULL);
+  config->Load();
 
   max_count = config->GetValue("maxcount");
   ntp1 = (char *)config->GetStringValue("ntp1");
@@ -75,9 +76,32 @@ void GetTime::begin() {
   sntp_setservername(1, ntp2);
   (void)sntp_set_timezone(timezone);
 
+  ConfigurationCallback cb = std::bind(&GetTime::ConfigChanged, this, std::placeholders::_1);
+  config->onChange("maxcount", cb);
+  config->onChange("ntp1", cb);
+  config->onChange("ntp2", cb);
+  config->onChange("timezone", cb);
+
   // Wire.begin();
 }
 
+// A new configuration file was uploaded. SNTP only takes new settings while stopped.
+void GetTime::ConfigChanged(ConfigurationItem *item) {
+  max_count = config->GetValue("maxcount");
+  if (item == config->GetItem("maxcount"))
+    return;
+
+  ntp1 = (char *)config->GetStringValue("ntp1");
+  ntp2 = (char *)config->GetStringValue("ntp2");
+  timezone = config->GetValue("timezone");
+
+  sntp_stop();
+  sntp_setservername(0, ntp1);
+  sntp_setservername(1, ntp2);
+  (void)sntp_set_timezone(timezone);
+  sntp_init();
+}
+
 /*
  * Wait for a correct time, and report it.
  * Don't wait longer than ... for it.
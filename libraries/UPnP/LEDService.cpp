@@ -158,6 +158,28 @@ void LEDService::begin() {
       config->GetValue("passive"));
 #endif
   }
+
+  ConfigurationCallback cb = std::bind(&LEDService::ConfigChanged, this, std::placeholders::_1);
+  config->onChange("pin", cb);
+  config->onChange("active", cb);
+  config->onChange("passive", cb);
+}
+
+// A new configuration file was uploaded
+void LEDService::ConfigChanged(ConfigurationItem *item) {
+  if (item == config->GetItem("pin")) {
+    digitalWrite(led, LOW);
+    led = item->GetValue();
+    pinMode(led, OUTPUT);
+    return;
+  }
+
+  if (config->configured("active") && config->configured("passive")) {
+    setPeriod(config->GetValue("active"), config->GetValue("passive"));
+    if (state == LED_STATE_OFF)
+      SetState(LED_STATE_BLINK);
+  } else if (state == LED_STATE_BLINK)
+    SetState(LED_STATE_OFF);
 }
 
 enum LEDState LEDService::GetState() {
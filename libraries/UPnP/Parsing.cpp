@@ -60,6 +60,7 @@ bool WebServer::_parseRequest(WiFiClient& client) {
     url = url.substring(0, hasSearch);
   }
   _currentUri = url;
+  _parseArguments(searchStr);
 
   HTTPMethod method = HTTP_GET;
   for (int i=HTTP_ANY; i<HTTP_END_METHODS; i++)
@@ -111,6 +112,8 @@ bool WebServer::_parseRequest(WiFiClient& client) {
     /* End HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE */
   } else if (method == HTTP_SUBSCRIBE) {
     /* HTTP_SUBSCRIBE */
+  } else if (method == HTTP_NOTIFY) {
+    /* HTTP_NOTIFY : the handler reads the propertyset */
   } else {
     /* HTTP_GET, HTTP_OPTIONS */
   }
@@ -127,6 +130,35 @@ bool WebServer::_parseRequest(WiFiClient& client) {
   return true;
 }
 
+// Split "a=1&b=2" into the request arguments, see arg().
+void WebServer::_parseArguments(String data) {
+  if (_currentArgs)
+    delete[] _currentArgs;
+  _currentArgs = 0;
+  _currentArgCount = 0;
+  if (data.length() == 0)
+    return;
+
+  int n = 1;
+  for (int i = 0; (i = data.indexOf('&', i)) != -1; i++)
+    n++;
+  _currentArgs = new RequestArgument[n];
+
+  int pos = 0;
+  while (_currentArgCount < n) {
+    int eq = data.indexOf('=', pos);
+    int next = data.indexOf('&', pos);
+    if (eq != -1 && (next == -1 || eq < next)) {
+      RequestArgument &arg = _currentArgs[_currentArgCount++];
+      arg.key = data.substring(pos, eq);
+      arg.value = (next == -1) ? data.substring(eq + 1) : data.substring(eq + 1, next);
+    }
+    if (next == -1)
+      break;
+    pos = next + 1;
+  }
+}
+
 // Taken from WebServer::parseRequest()
 // Only few cases actually have, and read, data after the headers.
 void WebServer::ReadData(int &len, char *&buffer) {
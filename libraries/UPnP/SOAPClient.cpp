@@ -0,0 +1,383 @@
+/*
+ * Invoke actions on other devices without waiting for them.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+
+#include "UPnP/SOAPClient.h"
+#include "UPnP/WebClient.h"
+
+// #undef DEBUG
+#define DEBUG Serial
+
+static const char *_soap_request_template =
+  "POST %s HTTP/1.1\r\n"
+  "HOST: %s:%d\r\n"
+  "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+  "SOAPACTION: \"%s#%s\"\r\n"
+  "CONTENT-LENGTH: %d\r\n"
+  "\r\n";
+
+static const char *_soap_body_template =
+  "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+  "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n"
+  "<s:Body><u:%s xmlns:u=\"%s\">%s</u:%s></s:Body>\r\n"
+  "</s:Envelope>\r\n";
+
+// Parser states
+#define	SOAP_PARSE_STATUS	0
+#define	SOAP_PARSE_HEADERS	1
+#define	SOAP_PARSE_BODY		2
+
+// Envelope, Body, the action's response element, then the out arguments
+#define	SOAP_ARG_DEPTH		4
+
+SOAPClient::SOAPClient() {
+  for (int i=0; i<SOAP_MAX_REQUESTS; i++) {
+    requests[i].id = 0;
+    requests[i].message = NULL;
+  }
+  for (int i=0; i<SOAP_MAX_CONNECTIONS; i++) {
+    connections[i].req = NULL;
+    connections[i].port = 0;
+    connections[i].idle = 0;
+  }
+  nextid = 1;
+}
+
+SOAPClient::~SOAPClient() {
+  for (int i=0; i<SOAP_MAX_CONNECTIONS; i++)
+    connections[i].client.stop();
+  for (int i=0; i<SOAP_MAX_REQUESTS; i++)
+    free(requests[i].message);
+}
+
+/*
+ * Queue an action. Args are the in arguments, already as XML (e.g. "<State>on</State>"),
+ * or NULL. Returns an id that is passed to the callback, or -1 if the request can't be made,
+ * in which case the callback isn't called.
+ */
+int SOAPClient::Invoke(const char *controlURL, const char *serviceType, const char *action,
+    const char *args, SOAPCallback cb, unsigned long timeout) {
+  struct Request *req = NULL;
+  for (int i=0; i<SOAP_MAX_REQUESTS && req == NULL; i++)
+    if (requests[i].id == 0)
+      req = &requests[i];
+  if (req == NULL)
+    return -1;
+
+  char host[40];
+  const char *path;
+  if (! WebClient::parseURL(controlURL, host, sizeof(host), req->port, path))
+    return -1;
+  if (! WebClient::resolve(host, req->ip))
+    return -1;
+
+  if (args == NULL)
+    args = "";
+  int bodylen = strlen(_soap_body_template) + 2 * strlen(action) + strlen(serviceType) + strlen(args);
+  int len = strlen(_soap_request_template) + strlen(path) + strlen(host) + 6
+    + strlen(serviceType) + strlen(action) + 6 + bodylen;
+  req->message = (char *)malloc(len);
+  if (req->message == NULL)
+    return -1;
+
+  // Render the body at the end of the buffer first, we need its length in the header
+  char *body = req->message + len - bodylen;
+  bodylen = sprintf(body, _soap_body_template, action, serviceType, args, action);
+  req->len = sprintf(req->message, _soap_request_template,
+    path, host, req->port, serviceType, action, bodylen);
+  memmove(req->message + req->len, body, bodylen + 1);
+  req->len += bodylen;
+
+  req->id = nextid++;
+  if (nextid <= 0)
+    nextid = 1;
+  req->cb = cb;
+  req->deadline = millis() + timeout;
+  req->sent = false;
+
+#ifdef DEBUG
+  DEBUG.printf("SOAPClient::Invoke(%s, %s) -> %d\n", controlURL, action, req->id);
+#endif
+  return req->id;
+}
+
+// Number of requests queued or in progress
+int SOAPClient::pending() {
+  int n = 0;
+  for (int i=0; i<SOAP_MAX_REQUESTS; i++)
+    if (requests[i].id)
+      n++;
+  return n;
+}
+
+const char *SOAPClient::Argument(struct SOAPResult *result, const char *name) {
+  if (result == NULL)
+    return NULL;
+  for (int i=0; i<result->nargs; i++)
+    if (strcmp(result->name[i], name) == 0)
+      return result->value[i];
+  return NULL;
+}
+
+void SOAPClient::Free(struct Request *req) {
+  free(req->message);
+  req->message = NULL;
+  req->cb = NULL;
+  req->id = 0;
+}
+
+/*
+ * Call this from the main loop : send queued requests over free connections,
+ * and process whatever the servers sent back.
+ */
+void SOAPClient::periodic() {
+  for (int i=0; i<SOAP_MAX_CONNECTIONS; i++) {
+    struct Connection *c = &connections[i];
+    if (c->req == NULL) {
+      if (c->port && (long)(millis() - c->idle - SOAP_IDLE_TIMEOUT) >= 0) {
+        c->client.stop();
+        c->port = 0;
+      }
+      continue;
+    }
+
+    char buf[128];
+    int n;
+    while (c->req && (n = c->client.available()) > 0) {
+      n = c->client.read((uint8_t *)buf, (n > sizeof(buf)) ? sizeof(buf) : n);
+      if (n <= 0)
+        break;
+      Parse(c, buf, n);
+    }
+    if (c->req == NULL)
+      continue;
+
+    if (! c->client.connected()) {
+      // Without Content-Length, the response ends when the server closes
+      if (c->state == SOAP_PARSE_BODY && c->remaining < 0) {
+        c->keepalive = false;
+        Complete(c, c->status);
+      } else
+        Complete(c, SOAP_ERROR_CLOSED);
+    } else if ((long)(millis() - c->req->deadline) >= 0)
+      Complete(c, SOAP_ERROR_TIMEOUT);
+  }
+
+  for (int i=0; i<SOAP_MAX_REQUESTS; i++) {
+    struct Request *req = &requests[i];
+    if (req->id == 0 || req->sent)
+      continue;
+    if ((long)(millis() - req->deadline) >= 0) {
+      SOAPCallback cb = req->cb;
+      int id = req->id;
+      Free(req);
+      if (cb)
+        cb(id, SOAP_ERROR_TIMEOUT, NULL);
+      continue;
+    }
+    Start(req);
+  }
+}
+
+/*
+ * Find a connection for this request. Only one request at a time goes to a host :
+ * small servers handle one client at a time anyway.
+ */
+bool SOAPClient::Start(struct Request *req) {
+  struct Connection *c = NULL, *reuse = NULL;
+
+  for (int i=0; i<SOAP_MAX_CONNECTIONS; i++) {
+    struct Connection *p = &connections[i];
+    if (p->port == req->port && p->ip == req->ip) {
+      if (p->req)
+        return false;			// Busy with this host, wait
+      if (p->client.connected())
+        reuse = p;
+    }
+    if (p->req == NULL && (c == NULL || ! p->port || (c->port && (long)(p->idle - c->idle) < 0)))
+      c = p;				// Prefer unused, then longest idle
+  }
+  if (reuse)
+    c = reuse;
+  if (c == NULL)
+    return false;
+
+  if (c != reuse) {
+    c->client.stop();
+    c->ip = req->ip;
+    c->port = req->port;
+    // Note : connecting is not asynchronous in this core, but on a LAN it's quick.
+    if (! c->client.connect(req->ip, req->port)) {
+      c->port = 0;
+      SOAPCallback cb = req->cb;
+      int id = req->id;
+      Free(req);
+      if (cb)
+        cb(id, SOAP_ERROR_CONNECT, NULL);
+      return true;
+    }
+    c->client.setNoDelay(true);
+  }
+
+  c->client.write((const uint8_t *)req->message, req->len);
+  req->sent = true;
+
+  c->req = req;
+  c->state = SOAP_PARSE_STATUS;
+  c->keepalive = false;
+  c->status = 0;
+  c->remaining = -1;
+  c->depth = 0;
+  c->linelen = 0;
+  c->inTag = c->capture = false;
+  c->result.nargs = 0;
+  return true;
+}
+
+void SOAPClient::Complete(struct Connection *c, int status) {
+  struct Request *req = c->req;
+  SOAPCallback cb = req->cb;
+  int id = req->id;
+
+  c->req = NULL;
+  c->idle = millis();
+  if (status < 0 || ! c->keepalive) {
+    c->client.stop();
+    c->port = 0;
+  }
+  Free(req);
+
+#ifdef DEBUG
+  DEBUG.printf("SOAPClient : request %d -> %d\n", id, status);
+#endif
+  if (cb)
+    cb(id, status, (status > 0) ? &c->result : NULL);
+}
+
+/*
+ * Streaming parser for the response : the status line and a few headers,
+ * then the text of the elements inside the action's response element.
+ */
+void SOAPClient::Parse(struct Connection *c, const char *buf, int len) {
+  for (int i=0; i<len && c->req; i++) {
+    char ch = buf[i];
+
+    if (c->state != SOAP_PARSE_BODY) {
+      if (ch == '\n') {
+        c->line[c->linelen] = 0;
+        Header(c);
+        c->linelen = 0;
+        if (c->state == SOAP_PARSE_BODY && c->remaining == 0)
+          Complete(c, c->status);
+      } else if (ch != '\r' && c->linelen < sizeof(c->line) - 1)
+        c->line[c->linelen++] = ch;
+      continue;
+    }
+
+    if (ch == '<') {
+      c->inTag = true;
+      c->linelen = 0;
+    } else if (c->inTag) {
+      if (ch == '>') {
+        c->line[c->linelen] = 0;
+        c->inTag = false;
+        Element(c);
+      } else if (c->linelen < sizeof(c->line) - 1)
+        c->line[c->linelen++] = ch;
+    } else if (c->capture && c->textlen < SOAP_ARG_LENGTH - 1)
+      c->result.value[c->result.nargs][c->textlen++] = ch;
+
+    if (c->remaining > 0 && --c->remaining == 0)
+      Complete(c, c->status);
+  }
+}
+
+// A complete line of the response header is in c->line
+void SOAPClient::Header(struct Connection *c) {
+  if (c->state == SOAP_PARSE_STATUS) {
+    // HTTP/1.1 200 OK : 1.1 connections stay open unless the server says otherwise
+    if (strncmp(c->line, "HTTP/", 5) != 0)
+      return;
+    c->keepalive = (strncmp(c->line + 5, "1.1", 3) == 0);
+    char *p = strchr(c->line, ' ');
+    c->status = p ? atoi(p+1) : 0;
+    c->state = SOAP_PARSE_HEADERS;
+    return;
+  }
+
+  if (c->linelen == 0) {
+    c->state = SOAP_PARSE_BODY;
+    return;
+  }
+  if (strncasecmp(c->line, "Content-Length:", 15) == 0)
+    c->remaining = atoi(c->line + 15);
+  else if (strncasecmp(c->line, "Connection:", 11) == 0) {
+    char *p = c->line + 11;
+    while (*p == ' ')
+      p++;
+    c->keepalive = (strncasecmp(p, "close", 5) != 0);
+  }
+}
+
+// A complete XML tag (without the < >) is in c->line
+void SOAPClient::Element(struct Connection *c) {
+  struct SOAPResult *r = &c->result;
+  char *tag = c->line;
+
+  if (tag[0] == '?' || tag[0] == '!')
+    return;
+
+  if (tag[0] == '/') {
+    if (c->depth == SOAP_ARG_DEPTH && c->capture) {
+      r->value[r->nargs][c->textlen] = 0;
+      r->nargs++;
+      c->capture = false;
+    }
+    c->depth--;
+    return;
+  }
+
+  bool empty = (c->linelen > 0 && tag[c->linelen - 1] == '/');
+  if (empty)
+    tag[--c->linelen] = 0;
+  if (c->depth + 1 == SOAP_ARG_DEPTH && r->nargs < SOAP_MAX_ARGS) {
+    // Argument name, without namespace prefix or attributes
+    char *p = strchr(tag, ':');
+    char *s = strchr(tag, ' ');
+    if (p && (s == NULL || p < s))
+      tag = p + 1;
+    int i;
+    for (i=0; tag[i] && tag[i] != ' ' && i < SOAP_ARG_LENGTH - 1; i++)
+      r->name[r->nargs][i] = tag[i];
+    r->name[r->nargs][i] = 0;
+    c->textlen = 0;
+    if (empty) {
+      r->value[r->nargs][0] = 0;
+      r->nargs++;
+    } else
+      c->capture = true;
+  }
+  if (! empty)
+    c->depth++;
+}
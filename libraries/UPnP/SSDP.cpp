@@ -31,8 +31,11 @@
  */
 #include "UPnP/UPnPDevice.h"
 #include "UPnP/SSDP.h"
+#include "UPnP/SSDPParser.h"
+#include "UPnP.h"
 #include "WiFiUdp.h"
 #include "debug.h"
+#include <FS.h>
 
 #include "lwip/udp.h"
 #include "lwip/igmp.h"
@@ -47,36 +50,98 @@
 #define SSDP_URI_SIZE     2
 #define SSDP_BUFFER_SIZE  64
 #define SSDP_MULTICAST_TTL 1
+#define SSDP_MAX_MX       5	// UPnP 1.1 : treat larger MX values as 5
+#define SSDP_TICK         100	// ms, also the pace of the announcement burst
+#define SSDP_BURST_REPEAT 2	// UDP is unreliable : send each announcement this often
+#define SSDP_BOOT_SPREAD  3000	// ms, random delay before the first announcement
+#define SSDP_SPREAD       1000	// ms, random delay before the others (doubling)
 
 static const IPAddress SSDP_MULTICAST_ADDR(239, 255, 255, 250);
 
+#define UPNP_EVENT_PORT   7900
+static const IPAddress UPNP_EVENT_MULTICAST_ADDR(239, 255, 255, 246);
+
 static const char *_ssdp_response_template =
   "HTTP/1.1 200 OK\r\n"	
   "EXT:\r\n"
-  "ST: upnp:rootdevice\r\n";
+  "ST: %s%s\r\n";				// search target
+
+static const char *_ssdp_rootdevice = "upnp:rootdevice";
 
 static const char *_ssdp_notify_template =
   "NOTIFY * HTTP/1.1\r\n"
   "HOST: 239.255.255.250:1900\r\n"
-  "NT: upnp:rootdevice\r\n"
+  "NT: %s%s\r\n"				// notification type
   "NTS: ssdp:alive\r\n";
 
 static const char *_ssdp_packet_template =
-  "%s"						// _ssdp_response_template / _ssdp_notify_template 
   "CACHE-CONTROL: max-age=%u\r\n"		// SSDP_INTERVAL
   "SERVER: Arduino/1.0 UPNP/1.1 %s/%s\r\n"	// _modelName, _modelNumber
-  "USN: uuid:%s\r\n"				// _uuid
+  "USN: uuid:%s%s%s\r\n"			// _uuid, "::", target
   "LOCATION: http://%u.%u.%u.%u:%u/%s\r\n"	// WiFi.localIP(), _port, _schemaURL
+  "BOOTID.UPNP.ORG: %u\r\n"			// _bootid
+  "\r\n";
+
+static const char *_ssdp_byebye_template =
+  "NOTIFY * HTTP/1.1\r\n"
+  "HOST: 239.255.255.250:1900\r\n"
+  "NT: %s%s\r\n"				// notification type
+  "NTS: ssdp:byebye\r\n";
+
+static const char *_ssdp_byebye_packet_template =
+  "USN: uuid:%s%s%s\r\n"			// _uuid, "::", target
+  "BOOTID.UPNP.ORG: %u\r\n"			// _bootid
+  "\r\n";
+
+// Per packet type, the part before _ssdp_packet_template
+static const char *_ssdp_head_templates[SSDP_PACKET_TYPES] = {
+  _ssdp_response_template,
+  _ssdp_notify_template,
+  _ssdp_byebye_template
+};
+
+static const char *_upnp_event_template =
+  "NOTIFY * HTTP/1.0\r\n"
+  "HOST: 239.255.255.246:7900\r\n"
+  "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+  "USN: uuid:%s::%s\r\n"			// _uuid, serviceType
+  "SVCID: %s\r\n"				// serviceId
+  "NT: upnp:event\r\n"
+  "NTS: upnp:propchange\r\n"
+  "SEQ: %u\r\n"
+  "LVL: %s\r\n"
+  "BOOTID.UPNP.ORG: %u\r\n"
+  "CONTENT-LENGTH: %d\r\n"
   "\r\n";
 
+static const char *_bootid_file = "/bootid";
+
 struct SSDPTimer {
   ETSTimer timer;
 };
 
 SSDPClass::SSDPClass() :
   _server(0),
+  _event(0),
+  _bootid(0),
+  _packets(0),
+  _packetlen(0),
+  _ntargets(0),
+  _stale(false),
+  _announcedIp(0),
+  _rejoin(false),
+  _burst(-1),
+  _burstDue(0),
+  _notify_time(0),
   _port(80),
-  _pending(false),
+  _ringHead(0),
+  _ringTail(0),
+  _overflows(0),
+  _oversize(0),
+  _device(false),
+  _nconsumers(0),
+  _nreplies(0),
+  _dropped(0),
   _timer(new SSDPTimer)
 {
 }
@@ -90,7 +155,7 @@ SSDPClass::~SSDPClass(){
 }
 
 bool SSDPClass::begin(UPnPDevice &dev){
-  _pending = false;
+  _device = true;
   device = dev;
   
   uint32_t chipId = ESP.getChipId();
@@ -104,80 +169,255 @@ bool SSDPClass::begin(UPnPDevice &dev){
   DEBUG_SSDP.printf("SSDP UUID: %s\n", (char *)device._uuid);
 #endif
 
+  _announcedIp = 0;
+  _burst = -1;
+  if (! _join())
+    return false;
+
+  _startTimer();
+
+  return true;
+}
+
+/*
+ * Only set up the socket, e.g. for a control point that doesn't announce a device.
+ * Does nothing if it's already there (e.g. from begin()).
+ */
+bool SSDPClass::listen() {
+  if (_server)
+    return true;
+  return _join();
+}
+
+bool SSDPClass::addConsumer(SSDPConsumer consumer) {
+  if (_nconsumers == SSDP_MAX_CONSUMERS)
+    return false;
+  _consumers[_nconsumers++] = consumer;
+  return true;
+}
+
+// Send a ready made packet (e.g. an M-SEARCH) to the SSDP multicast group
+void SSDPClass::multicast(const char *packet, int len) {
+  if (_server == 0)
+    return;
+  _server->append(packet, len);
+
+  ip_addr_t remoteAddr;
+  remoteAddr.addr = SSDP_MULTICAST_ADDR;
+  _server->send(&remoteAddr, SSDP_PORT);
+}
+
+// From our SSDP socket, so the answer comes back there too
+void SSDPClass::unicast(const char *packet, int len, uint32_t addr, uint16_t port) {
+  if (_server == 0)
+    return;
+  _server->append(packet, len);
+
+  ip_addr_t remoteAddr;
+  remoteAddr.addr = addr;
+  _server->send(&remoteAddr, port);
+}
+
+/*
+ * Set up our sockets, with a new boot id. Done at boot, and again when our IP address
+ * changes : always from the main loop, never from the timer (this does SPIFFS I/O).
+ */
+bool SSDPClass::_join() {
   if (_server) {
     _server->unref();
     _server = 0;
   }
+  if (_event) {
+    _event->unref();
+    _event = 0;
+  }
+
+  _server = _setupMulticast(SSDP_MULTICAST_ADDR, SSDP_PORT, true);
+  if (_server == 0)
+    return false;
+  _server->onRx(std::bind(&SSDPClass::_update, this));
+
+  // We only send multicast events, no need to join that group
+  _event = _setupMulticast(UPNP_EVENT_MULTICAST_ADDR, UPNP_EVENT_PORT, false);
+
+  // BOOTID.UPNP.ORG must increase each time we (re)join the network.
+  File f = SPIFFS.open(_bootid_file, "r");
+  if (f) {
+    _bootid = f.parseInt();
+    f.close();
+  }
+  _bootid++;
+  f = SPIFFS.open(_bootid_file, "w");
+  if (f) {
+    f.printf("%u\n", _bootid);
+    f.close();
+  }
 
-  _server = new UdpContext;
-  _server->ref();
+  return true;
+}
+
+UdpContext *SSDPClass::_setupMulticast(IPAddress group, uint16_t port, bool join) {
+  UdpContext *ctx = new UdpContext;
+  ctx->ref();
 
   ip_addr_t ifaddr;
   ifaddr.addr = WiFi.localIP();
   ip_addr_t multicast_addr;
-  multicast_addr.addr = (uint32_t) SSDP_MULTICAST_ADDR;
-  if (igmp_joingroup(&ifaddr, &multicast_addr) != ERR_OK ) {
+  multicast_addr.addr = (uint32_t) group;
+  if (join && igmp_joingroup(&ifaddr, &multicast_addr) != ERR_OK ) {
     DEBUGV("SSDP failed to join igmp group");
-    return false;
+    ctx->unref();
+    return 0;
   }
   
-  if (!_server->listen(*IP_ADDR_ANY, SSDP_PORT)) {
-    return false;
+  if (!ctx->listen(*IP_ADDR_ANY, join ? port : 0)) {
+    ctx->unref();
+    return 0;
   }
 
-  _server->setMulticastInterface(ifaddr);
-  _server->setMulticastTTL(SSDP_MULTICAST_TTL);
-  _server->onRx(std::bind(&SSDPClass::_update, this));
-  if (!_server->connect(multicast_addr, SSDP_PORT)) {
-    return false;
+  ctx->setMulticastInterface(ifaddr);
+  ctx->setMulticastTTL(SSDP_MULTICAST_TTL);
+  if (!ctx->connect(multicast_addr, port)) {
+    ctx->unref();
+    return 0;
   }
+  return ctx;
+}
 
-  _startTimer();
+/*
+ * UPnP 1.1 multicast event : one datagram reaches all listeners, instead of a
+ * TCP connection per subscriber. The body is the same propertyset as in GENA.
+ */
+void SSDPClass::SendEvent(const char *serviceType, const char *serviceId, const char *level,
+    uint32_t seq, const char *body, int bodylen) {
+  if (_event == 0)
+    return;
 
-  return true;
+  char buffer[384];
+  int len = snprintf(buffer, sizeof(buffer), _upnp_event_template,
+    device._uuid, serviceType, serviceId, seq, level, _bootid, bodylen);
+  if (len >= sizeof(buffer))
+    return;
+
+  _event->append(buffer, len);
+  _event->append(body, bodylen);
+
+  ip_addr_t remoteAddr;
+  remoteAddr.addr = UPNP_EVENT_MULTICAST_ADDR;
+  _event->send(&remoteAddr, UPNP_EVENT_PORT);
 }
 
-void SSDPClass::_send(ssdp_method_t method) {
-  char buffer[512];	// FIXME I've seen up to 280 but haven't calculated this
+/*
+ * The name of a search / notification target, e.g. "upnp:rootdevice".
+ * Prefix is "uuid:" for our UUID, because we don't keep that in the UUID itself.
+ */
+const char *SSDPClass::_targetName(int target, const char *&prefix) {
+  prefix = "";
+  switch (target) {
+  case SSDP_TARGET_ROOTDEVICE:
+    return _ssdp_rootdevice;
+  case SSDP_TARGET_UUID:
+    prefix = "uuid:";
+    return device._uuid;
+  case SSDP_TARGET_DEVICE:
+    return device.getDeviceURN();
+  default: {
+      UPnPService *srv = UPnP.getService(target - SSDP_TARGET_SERVICE);
+      return srv ? srv->serviceType : NULL;
+    }
+  }
+}
+
+/*
+ * Render the packets for all targets, once. They only change with our IP address,
+ * HTTP port, boot id or configuration (services added, or invalidate() called).
+ * That keeps the reply path down to an append and a send.
+ */
+void SSDPClass::_render() {
   uint32_t ip = WiFi.localIP();
-  
-  int len = snprintf(buffer, sizeof(buffer), 
-    _ssdp_packet_template,
-    (method == NONE)?_ssdp_response_template:_ssdp_notify_template,
-    SSDP_INTERVAL,
-    device._modelName, device._modelNumber,
-    device._uuid,
-    IP2STR(&ip), device.getPort(), device.getSchemaURL()
-  );
+  int ntargets = SSDP_TARGET_SERVICE + UPnP.getServiceCount();
+
+  if (_packets && !_stale && ip == _renderedIp && ntargets == _ntargets && device.getPort() == _renderedPort
+      && _bootid == _renderedBootid)
+    return;
+
+  for (int i=0; _packets && i<_ntargets * SSDP_PACKET_TYPES; i++)
+    free(_packets[i]);
+  free(_packets);
+  free(_packetlen);
+
+  _ntargets = ntargets;
+  _renderedIp = ip;
+  _renderedPort = device.getPort();
+  _renderedBootid = _bootid;
+  _stale = false;
+  _packets = (char **)malloc(ntargets * SSDP_PACKET_TYPES * sizeof(char *));
+  _packetlen = (int *)malloc(ntargets * SSDP_PACKET_TYPES * sizeof(int));
+
+  char buffer[512];	// FIXME I've seen up to 280 but haven't calculated this
+  for (int t=0; t<ntargets; t++)
+    for (int type=0; type<SSDP_PACKET_TYPES; type++) {
+      int ix = t * SSDP_PACKET_TYPES + type;
+      const char *prefix;
+      const char *name = _targetName(t, prefix);
+      _packets[ix] = NULL;
+      _packetlen[ix] = 0;
+      if (name == NULL)
+        continue;
+
+      int len = snprintf(buffer, sizeof(buffer), _ssdp_head_templates[type], prefix, name);
+      if (type == SSDP_PACKET_BYEBYE)
+        len += snprintf(buffer + len, sizeof(buffer) - len, _ssdp_byebye_packet_template,
+          device._uuid,
+          (t == SSDP_TARGET_UUID) ? "" : "::",
+          (t == SSDP_TARGET_UUID) ? "" : name,
+          _bootid
+        );
+      else
+        len += snprintf(buffer + len, sizeof(buffer) - len, _ssdp_packet_template,
+          SSDP_INTERVAL,
+          device._modelName, device._modelNumber,
+          device._uuid,
+          (t == SSDP_TARGET_UUID) ? "" : "::",
+          (t == SSDP_TARGET_UUID) ? "" : name,
+          IP2STR(&ip), device.getPort(), device.getSchemaURL(),
+          _bootid
+        );
+      if (len >= sizeof(buffer))
+        continue;
 #ifdef DEBUG_SSDPx
-  DEBUG_SSDP.printf("SSDPClass::_send() : len %d\n", len);
+      DEBUG_SSDP.printf("SSDPClass::_render(%d, %d) : len %d\n", t, type, len);
 #endif
+      _packets[ix] = (char *)malloc(len);
+      memcpy(_packets[ix], buffer, len);
+      _packetlen[ix] = len;
+    }
+}
+
+// Render the packets again, e.g. after the device description was changed.
+void SSDPClass::invalidate() {
+  _stale = true;
+}
 
-  _server->append(buffer, len);
+void SSDPClass::_sendPacket(int type, int target, uint32_t addr, uint16_t port) {
+  _render();
+  if (target >= _ntargets)
+    return;
+
+  int ix = target * SSDP_PACKET_TYPES + type;
+  if (_packets[ix] == NULL || _server == 0)
+    return;
+  _server->append(_packets[ix], _packetlen[ix]);
 
   ip_addr_t remoteAddr;
-  uint16_t remotePort;
-  if(method == NONE) {
-    remoteAddr.addr = _respondToAddr;
-    remotePort = _respondToPort;
-#ifdef DEBUG_SSDPx
-    DEBUG_SSDP.print("Sending Response to ");
-#endif
-  } else {
-    // method == SEARCH or NOTIFY
-    remoteAddr.addr = SSDP_MULTICAST_ADDR;
-    remotePort = SSDP_PORT;
-#ifdef DEBUG_SSDPx
-    DEBUG_SSDP.print("Sending Notify to ");
-#endif
-  }
+  remoteAddr.addr = addr;
 #ifdef DEBUG_SSDPx
+  DEBUG_SSDP.print("Sending to ");
   DEBUG_SSDP.print(IPAddress(remoteAddr.addr));
   DEBUG_SSDP.print(":");
-  DEBUG_SSDP.println(remotePort);
+  DEBUG_SSDP.println(port);
 #endif
-
-  _server->send(&remoteAddr, remotePort);
+  _server->send(&remoteAddr, port);
 }
 
 /*
@@ -198,98 +438,247 @@ void SSDPClass::_send(ssdp_method_t method) {
  * 
  */
 
-// These are the headers detected by the code.
-// Comment them out if we don't need them, will speed up the code.
-struct {
-  const char *header;
-  char *found;
-  int length;
-} headers [] = {
-#define M_SEARCH_HEADER 0
-  { "M-SEARCH", 0, 0},
-#define NOTIFY_HEADER 1
-  { "NOTIFY", 0, 0},
-  { "MAN:", 0, 0 },
-  { "MX:", 0, 0 },
-  { "ST:", 0, 0 },
-  { "USN:", 0, 0 },
-  { "NTS:", 0, 0 },
-  // { "HOST:", 0, 0 },		// This is not interesting information
-  { "LOCATION:", 0, 0 },
-  { 0, 0, 0 }
-};
-
-// Called when a packet is received on the UDP socket
+/*
+ * Called (from the network stack) when datagrams arrive on the UDP socket.
+ * Only copy them into the ring, they're processed from periodic().
+ * We are the only producer, periodic() the only consumer : each of them only
+ * writes its own index, so no locking is needed.
+ */
 void SSDPClass::_update() {
-  if(!_pending && _server->next()) {
-    _pending = true;
-
-    // This is picked up by _send()
-    _respondToAddr = _server->getRemoteAddress();
-    _respondToPort = _server->getRemotePort();
-
-    int ssdplen = _server->getSize();
-
-    // Allocate a byte extra before and after the message, this makes the rest of the code
-    // work with fewer tests or code duplication.
-    char *buffer = (char *)malloc(ssdplen+2);
-    _server->read(buffer+1, ssdplen);	// FIXME return value ?
-    buffer[0] = '\r';
-    buffer[ssdplen+1] = 0;
-
-    // Clear pointers
-    for (int i=0; headers[i].header; i++) {
-      headers[i].found = 0;
-      if (headers[i].length == 0)
-        headers[i].length = strlen(headers[i].header);
+  while (_server->next()) {
+    int len = _server->getSize();
+    if (len >= SSDP_RING_SLOT) {
+      _oversize++;		// Can't be an M-SEARCH or NOTIFY we care about
+      _server->flush();
+      continue;
+    }
+    uint8_t head = _ringHead;
+    if ((uint8_t)(head - _ringTail) == SSDP_RING_SIZE) {
+      _overflows++;
+      _server->flush();
+      continue;
     }
 
-    // Multi-step packet analysis : first cut into lines, detect headers
-    for (char *p = buffer; *p; p++) {
-      if (*p == '\r' || *p == '\n') {
-        *p = 0;
-      }
-      char *q = p+1;
-      
-      for (int i=0; headers[i].header; i++)
-	if (strncmp(headers[i].header, q, headers[i].length) == 0) {
-	  headers[i].found = q;
-	}
+    SSDPDatagram *d = &_ring[head % SSDP_RING_SIZE];
+    d->addr = _server->getRemoteAddress();
+    d->port = _server->getRemotePort();
+    d->len = _server->read(d->data, len);
+    _ringHead = head + 1;		// Publish the slot only when it's filled in
+  }
+}
+
+/*
+ * Call this from the main loop : process the datagrams received since last time.
+ */
+void SSDPClass::periodic() {
+  // Our address changed (see _tick) : new sockets and boot id, then announce again
+  if (_rejoin) {
+    _rejoin = false;
+    if (_join()) {
+      _announcedIp = WiFi.localIP();
+      _startBurst(SSDP_BOOT_SPREAD);
     }
+  }
 
-    // Send a reply
-    if (headers[M_SEARCH_HEADER].found)
-      _send(NONE);
-    else if (headers[NOTIFY_HEADER].found)
+  for (int n=0; n<SSDP_RING_SIZE && _ringTail != _ringHead; n++) {
+    SSDPDatagram *d = &_ring[_ringTail % SSDP_RING_SIZE];
+
+    // This is picked up by _queueReply()
+    _respondToAddr = d->addr;
+    _respondToPort = d->port;
+
+    SSDPMessage msg;
+    ssdp_message_t type = SSDPParse(d->data, d->len, &msg);
+    if (_device && type == SSDP_MSG_MSEARCH)
+      _search(msg.value[SSDP_HDR_ST], msg.value[SSDP_HDR_MX]);
+    else if (_device && type == SSDP_MSG_NOTIFY)
       RegisterNotify();
 
-    // End of processing, throw away buffer
-    free(buffer);
+    if (type != SSDP_MSG_UNKNOWN)
+      for (int i=0; i<_nconsumers; i++)
+        _consumers[i](msg, d->addr, d->port);
+
+    _ringTail++;
+  }
+}
+
+uint32_t SSDPClass::getOverflows() {
+  return _overflows + _oversize;
+}
+
+/*
+ * Work out which of our search targets match the ST, queue a reply for each of them.
+ * Arguments are the header values, e.g. "ssdp:all" and "3".
+ */
+void SSDPClass::_search(const char *st, const char *mx) {
+  if (st == NULL)
+    return;	// Not a valid M-SEARCH
+
+  // Spread the replies over the MX window, so control points don't get them all at once
+  int wait = mx ? atoi(mx) : 1;
+  if (wait < 1)
+    wait = 1;
+  if (wait > SSDP_MAX_MX)
+    wait = SSDP_MAX_MX;
+
+  int len = strlen(st);
+
+  int nservices = UPnP.getServiceCount();
+  bool all = (len == 8 && strncmp(st, "ssdp:all", 8) == 0);
+
+  uint32_t targets = 0;
+  for (int t = SSDP_TARGET_ROOTDEVICE; t < SSDP_TARGET_SERVICE + nservices && t < 32; t++) {
+    const char *prefix;
+    const char *name = _targetName(t, prefix);
+    if (name == NULL)
+      continue;
+    int skip = strlen(prefix);
+    if (all || (len == skip + strlen(name) && strncmp(st, prefix, skip) == 0
+        && strncmp(st + skip, name, len - skip) == 0))
+      targets |= (1U << t);
+  }
+  _queueReply(targets, wait * 1000L);
+}
+
+/*
+ * Remember a search : who asked, and which targets to answer, within window ms.
+ * A repeated search from the same control point (they often send two or three)
+ * joins the one already queued.
+ */
+void SSDPClass::_queueReply(uint32_t targets, unsigned long window) {
+  if (targets == 0)
+    return;
+  for (int i=0; i<_nreplies; i++)
+    if (_replies[i].addr == _respondToAddr && _replies[i].port == _respondToPort) {
+      // A repeated search : its MX window counts too, so don't cram its replies in the old one
+      SSDPReply *r = &_replies[i];
+      r->targets |= targets;
+      unsigned long end = millis() + window;
+      if ((long)(end - r->end) > 0)
+        r->end = end;
+      return;
+    }
+  if (_nreplies == SSDP_REPLY_QUEUE_SIZE) {
+    _dropped++;
+    return;
+  }
+  SSDPReply *r = &_replies[_nreplies++];
+  r->addr = _respondToAddr;
+  r->port = _respondToPort;
+  r->targets = targets;
+  r->end = millis() + window;
+  r->due = millis() + UPnPClass::jitter(window / __builtin_popcount(targets));
+}
 
-    _pending = false;
+// Send the replies whose time has come, keep the searches that need more in order.
+void SSDPClass::_sendReplies() {
+  int j = 0;
+  for (int i=0; i<_nreplies; i++) {
+    if ((long)(millis() - _replies[i].due) >= 0)
+      _sendReply(&_replies[i]);
+    if (_replies[i].targets)
+      _replies[j++] = _replies[i];
   }
+  _nreplies = j;
 }
 
-void SSDPClass::EverySecond() {
-  // No packet received, just periodically send out a NOTIFY
-  if (_notify_time == 0 || (millis() - _notify_time) > (SSDP_INTERVAL * 1000L)) {
-    _notify_time = millis();
-    _send(NOTIFY);
+/*
+ * Answer one target of this search. The next one is due at a random moment
+ * in its share of what's left of the MX window.
+ */
+void SSDPClass::_sendReply(SSDPReply *r) {
+  int target = __builtin_ctz(r->targets);
+  r->targets &= r->targets - 1;
+  _sendPacket(SSDP_PACKET_RESPONSE, target, r->addr, r->port);
+
+  if (r->targets) {
+    long left = (long)(r->end - millis());
+    r->due = millis() + (left > 0 ? UPnPClass::jitter(left / __builtin_popcount(r->targets)) : 0);
   }
 }
 
+uint32_t SSDPClass::getDropped() {
+  return _dropped;
+}
+
+// Our device's UUID (without "uuid:"), NULL if begin() wasn't called
+const char *SSDPClass::getUuid() {
+  return _device ? device.getUuid() : NULL;
+}
+
+/*
+ * Announce ourselves : an ssdp:alive for each target (rootdevice, uuid, device type,
+ * each service type), one per timer tick so we don't flood the network.
+ * Done at boot, when our IP address changes, and well before max-age runs out.
+ *
+ * After a power cut, all devices boot at the same time. So the burst starts after
+ * a random delay, and each repetition waits (randomly) up to twice as long as the previous.
+ */
+void SSDPClass::_tick() {
+  uint32_t ip = WiFi.localIP();
+  if (ip != _announcedIp) {
+    if (ip == 0)
+      return;	// Not connected, wait
+    if (_announcedIp != 0) {
+      // We have a new address : control points need to know we rebooted, in a way.
+      // Not from here : periodic() does that, and tries again if it fails.
+      _rejoin = true;
+      return;
+    }
+    _announcedIp = ip;
+    _startBurst(SSDP_BOOT_SPREAD);
+  }
+
+  if (_burst < 0 && (millis() - _notify_time) > (SSDP_INTERVAL * 1000L / 2))
+    _startBurst(SSDP_SPREAD);
+
+  if (_burst < 0 || (long)(millis() - _burstDue) < 0)
+    return;
+
+  if (_burst >= _ntargets * SSDP_BURST_REPEAT) {
+    _burst = -1;
+    return;
+  }
+  _sendPacket(SSDP_PACKET_ALIVE, _burst % _ntargets, SSDP_MULTICAST_ADDR, SSDP_PORT);
+  _burst++;
+
+  if (_burst % _ntargets == 0)
+    _burstDue = millis() + UPnPClass::jitter(SSDP_SPREAD << (_burst / _ntargets));
+}
+
+void SSDPClass::_startBurst(unsigned long spread) {
+  _burst = 0;
+  _notify_time = millis();
+  _burstDue = _notify_time + UPnPClass::jitter(spread);
+}
+
+/*
+ * Tell control points we're going away (call before a restart or OTA update),
+ * so they don't keep us in their cache until max-age runs out.
+ */
+void SSDPClass::byebye() {
+  if (_server == 0)
+    return;
+  _burst = -1;
+  _render();
+  for (int t=0; t<_ntargets; t++)
+    _sendPacket(SSDP_PACKET_BYEBYE, t, SSDP_MULTICAST_ADDR, SSDP_PORT);
+}
+
 void SSDPClass::RegisterNotify() {
   // Currently not keeping track of devices telling us they're alive
 }
 
 void SSDPClass::_onTimerStatic(SSDPClass* self) {
-  self->EverySecond();
+  self->_render();	// Not in the receive path, if at all possible
+  self->_sendReplies();
+  self->_tick();
 }
 
-// Call the _update method once every second.
+// Call the timer method every SSDP_TICK ms, fine enough to spread M-SEARCH replies.
 void SSDPClass::_startTimer() {
   ETSTimer* tm = &(_timer->timer);
-  const int interval = 1000;
+  const int interval = SSDP_TICK;
   os_timer_disarm(tm);
   os_timer_setfn(tm, reinterpret_cast<ETSTimerFunc*>(&SSDPClass::_onTimerStatic), reinterpret_cast<void*>(this));
   os_timer_arm(tm, interval, 1 /* repeat */);
@@ -0,0 +1,134 @@
+/*
+ * Single pass tokenizer for SSDP datagrams, shared by SSDPClass and DiscoveryManager.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#include <Arduino.h>
+#include "UPnP/SSDPParser.h"
+
+static const struct {
+  const char *name;
+  uint8_t length;
+  uint8_t header;
+} ssdp_headers[] = {
+  // Sorted by first character, see SSDPParse
+  { "BOOTID.UPNP.ORG", 15, SSDP_HDR_BOOTID },
+  { "CACHE-CONTROL", 13, SSDP_HDR_CACHE_CONTROL },
+  { "EXT", 3, SSDP_HDR_EXT },
+  { "LOCATION", 8, SSDP_HDR_LOCATION },
+  { "MAN", 3, SSDP_HDR_MAN },
+  { "MX", 2, SSDP_HDR_MX },
+  { "NT", 2, SSDP_HDR_NT },
+  { "NTS", 3, SSDP_HDR_NTS },
+  { "SERVER", 6, SSDP_HDR_SERVER },
+  { "ST", 2, SSDP_HDR_ST },
+  { "USN", 3, SSDP_HDR_USN },
+  { 0, 0, 0 }
+};
+
+/*
+ * Index of the first ssdp_headers entry for each letter, -1 if none.
+ * Only the entries starting with the same letter as the line get compared.
+ */
+static int8_t ssdp_first(char c) {
+  switch (toupper(c)) {
+  case 'B':	return 0;
+  case 'C':	return 1;
+  case 'E':	return 2;
+  case 'L':	return 3;
+  case 'M':	return 4;
+  case 'N':	return 6;
+  case 'S':	return 8;
+  case 'U':	return 10;
+  default:	return -1;
+  }
+}
+
+/*
+ * Look up the header name in line [p, colon), store the value that follows.
+ */
+static void ssdp_header(char *p, char *colon, char *end, SSDPMessage *msg) {
+  int first = ssdp_first(*p);
+  if (first < 0)
+    return;
+
+  int len = colon - p;
+  char c = toupper(*p);
+  for (int i=first; ssdp_headers[i].name && ssdp_headers[i].name[0] == c; i++)
+    if (ssdp_headers[i].length == len && strncasecmp(p, ssdp_headers[i].name, len) == 0) {
+      // Strip blanks around the value
+      char *v = colon + 1;
+      while (v < end && (*v == ' ' || *v == '\t'))
+        v++;
+      while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+      *end = 0;
+      msg->value[ssdp_headers[i].header] = v;
+      return;
+    }
+}
+
+ssdp_message_t SSDPParse(char *buffer, int len, SSDPMessage *msg) {
+  msg->type = SSDP_MSG_UNKNOWN;
+  for (int i=0; i<SSDP_HEADERS; i++)
+    msg->value[i] = NULL;
+
+  char *end = buffer + len;
+  char *line = buffer;
+  bool first = true;
+
+  while (line < end) {
+    // Find the end of the line, and the colon that ends the header name
+    char *colon = NULL, *eol;
+    for (eol = line; eol < end && *eol != '\r' && *eol != '\n' && *eol != 0; eol++)
+      if (*eol == ':' && colon == NULL)
+        colon = eol;
+
+    // Empty line : end of headers
+    if (eol == line && eol < end && *eol != 0)
+      break;
+
+    char *next = eol;
+    if (next < end && *next == '\r')
+      next++;
+    if (next < end && *next == '\n')
+      next++;
+    if (next == eol)
+      next++;		// Stray NUL, or end of buffer
+
+    if (first) {
+      first = false;
+      if (strncmp(line, "M-SEARCH ", 9) == 0)
+        msg->type = SSDP_MSG_MSEARCH;
+      else if (strncmp(line, "NOTIFY ", 7) == 0)
+        msg->type = SSDP_MSG_NOTIFY;
+      else if (eol - line >= 12 && strncmp(line, "HTTP/1.", 7) == 0 && strncmp(line + 8, " 200", 4) == 0)
+        msg->type = SSDP_MSG_RESPONSE;
+      else
+        return SSDP_MSG_UNKNOWN;
+    } else if (colon)
+      ssdp_header(line, colon, eol, msg);
+
+    line = next;
+  }
+  return msg->type;
+}
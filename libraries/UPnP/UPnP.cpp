@@ -57,6 +57,11 @@ UPnPClass::~UPnPClass() {
 void UPnPClass::begin(WebServer *http, UPnPDevice *device) {
   this->device = device;
   this->http = http;
+
+  // A new /config.txt gets compiled right away, see ConfigurationFile
+  http->onFileUpload([http]() {
+    ConfigFile.FileStored(http->httpUri());
+  });
 }
 
 const char *_http_header =
@@ -132,6 +137,41 @@ void UPnPClass::schema(WiFiClient client) {
   client.print(_upnp_device_template_2);
 }
 
+/*
+ * Call this from the main loop : work that shouldn't be done while handling a request.
+ */
+void UPnPClass::periodic() {
+  for (int i=0; i<nservices; i++) {
+    services[i]->PollSubscribers();
+    services[i]->ExpireSubscribers();
+    services[i]->SendInitialEvents();
+  }
+
+  // Strict priority : all urgent events go out, then at most one other event per call.
+  for (int i=0; i<nservices; i++)
+    services[i]->SendQueuedEvents(EVENT_PRIORITY_HIGH, MAX_VARIABLES);
+  for (int i=0; i<nservices; i++) {
+    int s = (nextservice + i) % nservices;
+    if (services[s]->SendQueuedEvents(EVENT_PRIORITY_NORMAL, 1)) {
+      nextservice = s + 1;	// Round robin among services
+      break;
+    }
+  }
+}
+
+/*
+ * Random delay in [0, max) ms. Seeded with the chip id, so devices that boot at the
+ * same moment (e.g. after a power cut) don't all pick the same delays.
+ */
+unsigned long UPnPClass::jitter(unsigned long max) {
+  static bool seeded = false;
+  if (! seeded) {
+    randomSeed(ESP.getChipId() ^ micros());
+    seeded = true;
+  }
+  return max ? random(max) : 0;
+}
+
 void UPnPClass::addService(UPnPService *srv) {
   if (nservices == maxservices) {
     maxservices += N_SERVICES;
@@ -215,3 +255,52 @@ void UPnPClass::EventHandler() {
       return;
     }
 }
+
+// This is a pass-through for UPnPClass::JournalHandler, called from UPnPService.
+void staticJournalHandler() {
+  UPnP.JournalHandler();
+}
+
+// URL is e.g. "/BMP180/events?since=12", the web server has already stripped the arguments.
+void UPnPClass::JournalHandler() {
+  UPnPService *srv = FindService(HTTP.httpUri());
+  if (srv)
+    srv->JournalHandler();
+}
+
+// This is a pass-through for UPnPClass::SubscribersHandler, called from UPnPService.
+void staticSubscribersHandler() {
+  UPnP.SubscribersHandler();
+}
+
+void UPnPClass::SubscribersHandler() {
+  UPnPService *srv = FindService(HTTP.httpUri());
+  if (srv)
+    srv->SubscribersHandler();
+}
+
+int UPnPClass::getServiceCount() {
+  return nservices;
+}
+
+UPnPService *UPnPClass::getService(int i) {
+  return (i >= 0 && i < nservices) ? services[i] : NULL;
+}
+
+/*
+ * Find the service from a URL such as "/LEDService/scpd.xml".
+ */
+UPnPService *UPnPClass::FindService(const char *url) {
+  const char *name = url+1;
+  const char *p;
+
+  for (p=name; *p && *p != '/'; p++) ;
+  if (*p == '\0')
+    return NULL;
+
+  int len = (p-name);
+  for (int i=0; i<nservices; i++)
+    if (strncmp(name, services[i]->serviceName, len) == 0 && services[i]->serviceName[len] == '\0')
+      return services[i];
+  return NULL;
+}
@@ -75,6 +75,13 @@ class UPnPClass {
     static const char *envelopeTrailer;
 
     void EventHandler();
+    void JournalHandler();
+    void SubscribersHandler();
+    UPnPService *FindService(const char *url);
+    int getServiceCount();
+    UPnPService *getService(int i);
+    void periodic();
+    static unsigned long jitter(unsigned long max);
 
   private:
     UPnPDevice *device;
@@ -83,11 +90,14 @@ class UPnPClass {
   protected:
     UPnPService **services;
     int nservices, maxservices;
+    int nextservice;		// Round robin for EVENT_PRIORITY_NORMAL events
 };
 
 extern UPnPClass UPnP;
 extern const char *_http_header;
 extern void staticSendSCPD();
 extern void staticEventHandler();
+extern void staticJournalHandler();
+extern void staticSubscribersHandler();
 
 #endif
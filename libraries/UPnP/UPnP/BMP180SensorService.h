@@ -33,6 +33,14 @@
 #include <UPnP/WebServer.h>
 
 #define BMP180_STATE_LENGTH	16
+#define	BMP180_OVERSAMPLING_DEFAULT	0	// 0 .. 3, see SFE_BMP180::startPressure
+
+// Where poll() is in a measurement : each conversion is started, and picked up later
+enum BMP180State {
+  BMP180_STATE_IDLE,
+  BMP180_STATE_TEMPERATURE,
+  BMP180_STATE_PRESSURE
+};
 
 class BMP180SensorService : public UPnPService {
   public:
@@ -58,6 +66,9 @@ class BMP180SensorService : public UPnPService {
     double newPressure, newTemperature;
     double oldPressure, oldTemperature;
     int percentage;	// How much of a difference before notify
+    int oversampling;
+    enum BMP180State state;
+    unsigned long ready;	// millis() when the conversion is done
     char *name;
     SFE_BMP180 *bmp;
 
@@ -65,6 +76,8 @@ class BMP180SensorService : public UPnPService {
     void UpdateTemperature();
     void UpdatePressure();
     bool Difference(float oldval, float newval);
+    void Measured();
+    void ConfigChanged(ConfigurationItem *item);
 };
 
 #endif /* _INCLUDE_BMP180_SENSOR_SERVICE_H_ */
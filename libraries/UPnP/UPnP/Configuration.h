@@ -25,6 +25,9 @@
 #ifndef _UPNP_CONFIGURATION_READER_H_
 #define _UPNP_CONFIGURATION_READER_H_
 
+#include <Arduino.h>
+#include <functional>
+
 enum ValueType {
   TYPE_NONE,
   TYPE_DEFAULT_INT,
@@ -33,21 +36,35 @@ enum ValueType {
   TYPE_STRING
 };
 
+class ConfigurationItem;
+struct ConfigurationEntry;
+typedef std::function<void(ConfigurationItem *item)> ConfigurationCallback;
+
 class ConfigurationItem {
 private:
   const char *name;
+  uint32_t hash;		// Of the name, case insensitive
   enum ValueType type;
   int   ivalue;
   const char *svalue;
+  int   idefault;		// To go back to when the file no longer has us
+  const char *sdefault;
+  ConfigurationCallback changed;
 public:
   ConfigurationItem(const char *name, int value);
   ConfigurationItem(const char *name, const char *value);
   const char *GetName();
+  uint32_t GetHash();
   int GetValue();
   char *GetStringValue();
   enum ValueType GetType();
   void SetValue(int v);
   void SetValue(char *v);
+  void Apply(const char *text);
+  void Apply(int v);
+  bool Update(const struct ConfigurationEntry *e);
+  void onChange(ConfigurationCallback cb);
+  void Changed();
 };
 
 class Configuration {
@@ -62,5 +79,72 @@ public:
   int GetValue(const char *name);
   char *GetStringValue(const char *name);
   bool configured(const char *name);
+  void Load();
+  int Reload();
+  void onChange(const char *itemname, ConfigurationCallback cb);
+};
+
+/*
+ * The configuration file, read once and shared by all Configurations.
+ * Lines look like "section:key:value", e.g. "LED:pin:2".
+ *
+ * The text is compiled into a binary image (also stored as /config.bin, so later
+ * boots don't parse text) : a directory of entries sorted by a hash of section
+ * and key, then the strings. Lookups binary search the directory, and return
+ * pointers into the image.
+ */
+#define	CONFIG_MAX_ENTRIES	64
+#define	CONFIG_MAX_CONFIGURATIONS	16
+#define	CONFIG_MAGIC		0x32435055	// "UPC2"
+
+#define	CONFIG_VALUE_STRING	0
+#define	CONFIG_VALUE_INT	1
+
+struct ConfigurationHeader {
+  uint32_t	magic;
+  uint32_t	textsize;	// Of the config.txt this came from
+  uint32_t	checksum;	// Of its text, see Checksum()
+  uint16_t	count;		// Entries
+  uint16_t	size;		// Of the whole image
 };
+
+struct ConfigurationEntry {
+  uint32_t	hash;
+  uint16_t	section, key, value;	// Offsets in the image
+  uint8_t	type;		// CONFIG_VALUE_*
+  uint8_t	pad;
+  int32_t	ivalue;		// If CONFIG_VALUE_INT
+};
+
+class ConfigurationFile {
+public:
+  ConfigurationFile();
+  bool Load();
+  void Unload();
+  const struct ConfigurationEntry *FindEntry(const char *section, const char *key);
+  const char *Find(const char *section, const char *key);
+  const char *GetString(uint16_t offset);
+  void FileStored(const char *path);
+  void Register(Configuration *config);
+  int getReads();
+  unsigned long getLoadTime();
+
+  static uint32_t Hash(const char *s, uint32_t h);
+
+private:
+  bool loaded;
+  char *image;
+  struct ConfigurationHeader *header;
+  struct ConfigurationEntry *entries;
+  int reads;			// Times a file was read from SPIFFS
+  unsigned long loadtime;	// ms
+  Configuration *configs[CONFIG_MAX_CONFIGURATIONS];	// To reload after an upload
+  int nconfigs;
+
+  bool ReadImage(uint32_t textsize, uint32_t checksum);
+  bool Compile(char *text, uint32_t textsize, uint32_t checksum);
+  static uint32_t Checksum(const char *text, uint32_t len);
+};
+
+extern ConfigurationFile ConfigFile;
 #endif /* _UPNP_CONFIGURATION_READER_H_ */
@@ -0,0 +1,107 @@
+/*
+ * Fetch the description (LOCATION URL) of discovered devices in the background,
+ * and remember what they offer.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef _INCLUDE_DESCRIPTION_FETCHER_H_
+#define _INCLUDE_DESCRIPTION_FETCHER_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <functional>
+
+#define	DESCRIPTION_MAX_CONNECTIONS	2	// Fetches in progress at the same time
+#define	DESCRIPTION_CACHE_SIZE		32
+#define	DESCRIPTION_MAX_SERVICES	4
+#define	DESCRIPTION_TIMEOUT		5000	// ms
+#define	DESCRIPTION_RETRY		60000	// ms, after a failure
+
+enum DescriptionState {
+  DESCRIPTION_FREE,
+  DESCRIPTION_PENDING,			// Waiting for a connection
+  DESCRIPTION_FETCHING,
+  DESCRIPTION_DONE,
+  DESCRIPTION_FAILED
+};
+
+/*
+ * What a device told us in its description, cached by USN hash and BOOTID.UPNP.ORG :
+ * it is only fetched again when the device reboots.
+ */
+struct DeviceCapabilities {
+  uint64_t	hash;			// See DiscoveryManager::Hash
+  uint32_t	bootid;
+  enum DescriptionState state;
+  unsigned long	retry;			// millis(), when failed
+  char		*location;
+  char		*deviceType;
+  char		*friendlyName;
+  char		*services[DESCRIPTION_MAX_SERVICES];	// serviceType
+  char		*controlURL[DESCRIPTION_MAX_SERVICES];	// As in the description, may be relative
+  char		*eventSubURL[DESCRIPTION_MAX_SERVICES];
+  int		nservices;
+};
+
+typedef std::function<void(struct DeviceCapabilities *caps)> DescriptionCallback;
+
+class DescriptionFetcher {
+  public:
+    DescriptionFetcher();
+    ~DescriptionFetcher();
+
+    void Request(uint64_t hash, uint32_t bootid, const char *location);
+    struct DeviceCapabilities *Find(uint64_t hash);
+    void onFetched(DescriptionCallback cb);
+    void periodic();
+
+  private:
+    struct DeviceCapabilities cache[DESCRIPTION_CACHE_SIZE];
+    int victim;				// Next cache entry to reuse
+
+    /*
+     * One connection, with the state of the streaming XML parser :
+     * we only look at a few elements, and don't keep the document.
+     */
+    struct Fetch {
+      WiFiClient client;
+      struct DeviceCapabilities *caps;	// NULL : not in use
+      unsigned long deadline;
+      uint8_t state;			// In the response : headers, text, tag
+      uint8_t eoh;			// Matched part of the empty line after the headers
+      uint8_t capture;			// Element we're collecting the text of
+      int8_t service;			// Index of the service element we're in, -1 if not kept
+      uint8_t taglen, textlen;
+      char tag[20];
+      char text[80];
+    } fetches[DESCRIPTION_MAX_CONNECTIONS];
+
+    DescriptionCallback callback;
+
+    void Clear(struct DeviceCapabilities *caps);
+    bool Start(struct Fetch *f, struct DeviceCapabilities *caps);
+    void Finish(struct Fetch *f, bool ok);
+    void Parse(struct Fetch *f, const char *buf, int len);
+    void Element(struct Fetch *f);
+};
+
+#endif /* _INCLUDE_DESCRIPTION_FETCHER_H_ */
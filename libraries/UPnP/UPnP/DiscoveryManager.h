@@ -31,22 +31,83 @@
 #include "UPnP.h"
 #include "UPnP/UPnPService.h"
 #include <UPnP/WebServer.h>
+#include "UPnP/SSDPParser.h"
+#include "UPnP/DescriptionFetcher.h"
 
 #define DISCOVER_PIN_DEFAULT		0
 #define	DISCOVER_PASSIVE_DEFAULT	190
 #define	DISCOVER_ACTIVE_DEFAULT		10
 
-#define	DISCOVER_DEVICES_INCREMENT	8
+// ms, random delay before the first query
+#define	DISCOVERY_QUERY_SPREAD		5000
+
+#define	DISCOVERY_SEARCH_COPIES		3	// Each M-SEARCH is sent this often
+#define	DISCOVERY_SEARCH_MIN		10	// Seconds between searches, at first
+#define	DISCOVERY_SEARCH_INTERVAL	600	// Seconds between searches, at most
+#define	DISCOVERY_QUERY_LENGTH		320
+
+/*
+ * Device table : fixed size, looked up by a hash of the device UUID (the part of the USN
+ * before "::"), with chaining. Strings are interned : many devices share their type and
+ * SERVER string.
+ */
+#define	DISCOVER_MAX_DEVICES		32
+#define	DISCOVER_BUCKETS		16	// Power of two
+// USN, LOCATION and friendlyName are per device, types and SERVER strings are mostly shared
+#define	DISCOVER_MAX_STRINGS		(3 * DISCOVER_MAX_DEVICES + 16)
+#define	DISCOVER_DEFAULT_MAX_AGE	1800	// Seconds, if CACHE-CONTROL is absent
+
+/*
+ * Presence : a device that we haven't heard from (announcement, search reply, event)
+ * for PRESENCE_INTERVAL gets a unicast M-SEARCH. If a few of those go unanswered,
+ * it is considered lost. Devices wait for their next check in a timing wheel with
+ * one slot per second, so each tick only looks at the devices due then.
+ * All delays must be shorter than the wheel.
+ */
+#define	PRESENCE_WHEEL_SLOTS		64
+#define	PRESENCE_INTERVAL		60	// Seconds of silence before we probe
+#define	PRESENCE_PROBE_TIMEOUT		5	// Seconds
+#define	PRESENCE_MAX_PROBES		3
+
+enum DevicePresence {
+  PRESENCE_ALIVE,
+  PRESENCE_SUSPECT,		// Probed, no answer yet
+  PRESENCE_LOST
+};
 
 struct DiscoveredDevice {
+  uint64_t	hash;		// 0 : free entry
+  int8_t	next;		// Hash chain, or free list
   IPAddress	ip;
   uint16_t	port;
-  char		*usn;
-  char		*location;
-  char		*upnptype;
-  char		*friendlyname;
+  unsigned long	expires;	// millis()
+  uint32_t	bootid;		// BOOTID.UPNP.ORG, 0 if not sent
+  unsigned long	lastseen;	// millis()
+  uint8_t	presence;	// enum DevicePresence
+  uint8_t	probes;		// Unanswered since lastseen
+  int8_t	wprev, wnext;	// Timing wheel slot list
+  uint8_t	wslot;
+  const char	*usn;
+  const char	*location;
+  const char	*upnptype;	// The most specific NT/ST seen, see TypeRank()
+  const char	*friendlyname;
 };
 
+struct InternedString {
+  uint32_t	hash;
+  uint16_t	refs;		// 0 : free entry
+  char		*s;
+};
+
+enum DiscoveryEvent {
+  DISCOVERY_ADDED,
+  DISCOVERY_UPDATED,		// Address, location, type or description changed, or back after being lost
+  DISCOVERY_REMOVED,		// ssdp:byebye, or max-age expired
+  DISCOVERY_LOST		// Stopped answering, see PRESENCE_INTERVAL
+};
+
+typedef std::function<void(struct DiscoveredDevice *dev, enum DiscoveryEvent ev)> DiscoveryCallback;
+
 class DiscoveryManager : public UPnPService {
   public:
     DiscoveryManager();
@@ -56,6 +117,9 @@ class DiscoveryManager : public UPnPService {
     void AddConfiguredServers();
     bool QuerySensors();
     bool QuerySensors(const char *);
+    void setSearchInterval(unsigned int seconds);
+    void setExpectedDevices(int n);
+    unsigned long getDiscoveryLatency();
 
     /*
     DiscoveryManager(const char *deviceURN);
@@ -68,21 +132,55 @@ class DiscoveryManager : public UPnPService {
     void setPeriod(int active, int passive);
     /* */
     void periodic();
+    void onDevice(DiscoveryCallback cb);
+    struct DiscoveredDevice *FindDevice(const char *usn);
+    struct DeviceCapabilities *getCapabilities(struct DiscoveredDevice *dev);
+    void Heard(uint32_t addr);
     
   private:
     Configuration *config;
-    UdpContext* udpctx;
     void receivePacket();
-    char *packet, *buffer;
-    WiFiUDP udp;
+    // M-SEARCH scheduling, see QuerySensors()
+    char query[DISCOVERY_QUERY_LENGTH];
+    int querylen;
+    int querycopies;		// Copies of the search left to send in this round
+    unsigned long queryat;	// millis() of the next send
+    unsigned int interval, backoff;	// Seconds
+    void Search();
+
+    int expected;		// Number of devices we expect to find
+    unsigned long searchstart, latency;
+
+    void ProcessMessage(SSDPMessage &msg, uint32_t addr, uint16_t port);
+
+    void AddDevice(SSDPMessage &msg, uint32_t addr, uint16_t port);
+    void RemoveDevice(struct DiscoveredDevice *dev);
+    unsigned long ticktime;
+
+    int8_t wheel[PRESENCE_WHEEL_SLOTS];
+    uint8_t wheelpos;
+    void Tick();
+    void Check(struct DiscoveredDevice *dev);
+    void Schedule(struct DiscoveredDevice *dev, int seconds);
+    void Unschedule(struct DiscoveredDevice *dev);
+    bool Seen(struct DiscoveredDevice *dev);
+    void Probe(struct DiscoveredDevice *dev);
+
+    DescriptionFetcher fetcher;
+    void DescriptionFetched(struct DeviceCapabilities *caps);
 
-    void ProcessPacket(char *packet);
+    int8_t buckets[DISCOVER_BUCKETS];
+    int8_t freelist;
+    DiscoveryCallback callback;
+    struct InternedString strings[DISCOVER_MAX_STRINGS];
+    const char *Intern(const char *s);
+    void Release(const char *s);
+    static uint64_t Hash(const char *usn);
+    int8_t *Lookup(uint64_t hash);
 
-    void AddDevice();
-    void RemoveDevice();
   public:
-    struct DiscoveredDevice *devices;
-    int ndevices, maxdevices;
+    struct DiscoveredDevice devices[DISCOVER_MAX_DEVICES];
+    int ndevices;
 };
 
 #define DISCOVER_GLOBAL
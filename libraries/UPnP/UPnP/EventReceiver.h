@@ -0,0 +1,127 @@
+/*
+ * Receive events (GENA NOTIFY) from the devices a controller subscribed to.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef _INCLUDE_EVENT_RECEIVER_H_
+#define _INCLUDE_EVENT_RECEIVER_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <functional>
+#include "UPnP/StateVariable.h"
+
+/*
+ * Subscriptions are found by SID through a small hash table with chaining,
+ * so a burst of events from many sensors costs little per NOTIFY.
+ */
+#define	EVENT_MAX_SUBSCRIPTIONS		32
+#define	EVENT_BUCKETS			16	// Power of two
+#define	EVENT_MAX_VARS			4	// Per subscription
+#define	EVENT_VAR_NAME_LENGTH		16
+#define	EVENT_SUBSCRIBE_TIMEOUT		1800	// Seconds, what we ask for
+#define	EVENT_RETRY			30000	// ms, after a failed SUBSCRIBE
+#define	EVENT_REPLY_TIMEOUT		2000	// ms, waiting for the SUBSCRIBE reply
+#define	EVENT_MAX_CONNECTIONS		2	// (UN)SUBSCRIBE requests in progress
+#define	EVENT_SID_LENGTH		48
+
+enum EventRequest {
+  EVENT_REQUEST_NONE,
+  EVENT_REQUEST_SUBSCRIBE,	// New subscription, or a fresh one after missed events
+  EVENT_REQUEST_RENEW,		// SUBSCRIBE with SID
+  EVENT_REQUEST_UNSUBSCRIBE
+};
+
+struct EventVariable {
+  char		name[EVENT_VAR_NAME_LENGTH];
+  char		value[STATEVAR_VALUE_LENGTH];
+};
+
+struct EventSubscription {
+  uint32_t	hash;		// Of the SID, 0 : not subscribed (yet)
+  int8_t	next;		// Hash chain
+  char		*url;		// eventSubURL, NULL : free entry
+  char		*sid;
+  uint32_t	seq;		// Next SEQ we expect
+  uint32_t	gaps;		// Number of times events went missing
+  bool		resync;		// Get a fresh subscription (and initial event) at renew time
+  bool		busy;		// A request for it is in progress
+  unsigned long	renew;		// millis(), when to subscribe (again) or renew
+  int		nvars;
+  struct EventVariable vars[EVENT_MAX_VARS];
+};
+
+typedef std::function<void(struct EventSubscription *sub, const char *name, const char *value)> EventCallback;
+
+class EventReceiver {
+  public:
+    EventReceiver();
+    ~EventReceiver();
+    void begin(uint16_t port = 80);
+
+    struct EventSubscription *Subscribe(const char *url);
+    void Unsubscribe(struct EventSubscription *sub, bool tell = true);
+    struct EventSubscription *FindSubscription(const char *url);
+    int Index(struct EventSubscription *sub);
+    struct EventSubscription *getSubscription(int i);
+    const char *getValue(struct EventSubscription *sub, const char *name);
+    void onEvent(EventCallback cb);
+    void periodic();
+    void Update(struct EventSubscription *sub, const char *name, const char *value);
+
+  private:
+    struct EventSubscription subs[EVENT_MAX_SUBSCRIPTIONS];
+    int8_t buckets[EVENT_BUCKETS];
+    uint16_t port;
+    EventCallback callback;
+
+    /*
+     * A SUBSCRIBE, renewal or UNSUBSCRIBE in progress. The reply is parsed line by line
+     * from periodic() as it comes in, nothing waits for it.
+     */
+    struct Exchange {
+      WiFiClient	client;
+      struct EventSubscription *sub;	// NULL for UNSUBSCRIBE (the subscription is gone)
+      uint8_t		kind;		// enum EventRequest, NONE : free
+      bool		linked;		// The SID in the reply is in use already
+      unsigned long	deadline;
+      int		status;
+      int		timeout;	// Seconds, as granted
+      uint8_t		linelen;
+      char		line[80];
+      char		*oldsid;	// To unsubscribe once the fresh subscription is there
+    } exchanges[EVENT_MAX_CONNECTIONS];
+
+    void NotifyHandler();
+    struct EventSubscription *FindSID(const char *sid);
+    struct Exchange *FreeExchange();
+    bool Start(struct Exchange *x, struct EventSubscription *sub, uint8_t kind, const char *url, const char *sid);
+    void Poll();
+    void Line(struct Exchange *x);
+    void Finish(struct Exchange *x);
+    void Link(struct EventSubscription *sub, const char *sid);
+    void Unlink(struct EventSubscription *sub);
+    static uint32_t Hash(const char *sid);
+    int8_t *Lookup(uint32_t hash);
+};
+
+#endif /* _INCLUDE_EVENT_RECEIVER_H_ */
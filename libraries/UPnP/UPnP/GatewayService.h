@@ -0,0 +1,71 @@
+/*
+ * Gateway : one node that watches all sensors, so clients don't have to.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef _INCLUDE_GATEWAY_SERVICE_H_
+#define _INCLUDE_GATEWAY_SERVICE_H_
+
+#include "UPnP.h"
+#include "UPnP/UPnPService.h"
+#include "UPnP/DiscoveryManager.h"
+#include "UPnP/EventReceiver.h"
+#include "UPnP/SOAPClient.h"
+
+// Sensors (devices) whose changes are passed on as events of this service, one variable each
+#define	GATEWAY_MAX_SENSORS	16
+
+struct GatewaySensor {
+  uint64_t	hash;		// Of the device, see DiscoveryManager. 0 : free
+  char		*location;
+  struct EventSubscription *subs[DESCRIPTION_MAX_SERVICES];	// One per evented service
+};
+
+class GatewayService : public UPnPService {
+  public:
+    GatewayService();
+    ~GatewayService();
+
+    void begin(DiscoveryManager *dm, uint16_t port = 80);
+    void periodic();
+    void GetAllHandler();
+
+  private:
+    DiscoveryManager *dm;
+    EventReceiver events;
+    struct GatewaySensor sensors[GATEWAY_MAX_SENSORS];	// Sensor00 follows sensors[0], ...
+    SOAPClient soap;		// Ask new sensors for their state, events only tell changes
+
+    // Load : events received from sensors, and queries answered instead of them
+    uint32_t received, served;
+    bool querying;		// SensorEvent() called for a query result, not a NOTIFY
+
+    void DeviceChanged(struct DiscoveredDevice *dev, enum DiscoveryEvent ev);
+    void SensorEvent(struct EventSubscription *sub, const char *name, const char *value);
+    int FindSensor(uint64_t hash, bool create);
+    int FindSensor(struct EventSubscription *sub);
+    void RemoveSensor(int ix);
+    void StateQueried(struct EventSubscription *sub, int id, int status, struct SOAPResult *result);
+    char *ServiceURL(const char *location, const char *url);
+};
+
+#endif /* _INCLUDE_GATEWAY_SERVICE_H_ */
@@ -49,5 +49,6 @@ class GetTime {
   private:
     Configuration *config;
     TimeSource timeSource;
+    void ConfigChanged(ConfigurationItem *item);
 };
 #endif /* _INCLUDE_TIME_H_ */
@@ -32,6 +32,7 @@ enum HTTPMethod {
 	// UPnP
 	HTTP_SUBSCRIBE,
 	HTTP_UNSUBSCRIBE,
+	HTTP_NOTIFY,
 
 	//
 	HTTP_END_METHODS
@@ -48,6 +49,7 @@ static const char *http_method_strings[] = {
 	"OPTIONS",
 	"SUBSCRIBE",
 	"UNSUBSCRIBE",
+	"NOTIFY",
 
 
 	NULL
@@ -75,6 +75,7 @@ class LEDService : public UPnPService {
     enum LEDState state;
     int count, passive, active;
     void periodicBlink();
+    void ConfigChanged(ConfigurationItem *item);
 
 };
 
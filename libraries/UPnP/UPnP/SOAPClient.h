@@ -0,0 +1,108 @@
+/*
+ * Invoke actions on other devices without waiting for them.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+#ifndef _INCLUDE_SOAP_CLIENT_H_
+#define _INCLUDE_SOAP_CLIENT_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <functional>
+
+#define	SOAP_MAX_CONNECTIONS	4	// Connection pool
+#define	SOAP_MAX_REQUESTS	16	// Queued or in progress
+#define	SOAP_MAX_ARGS		4	// Out arguments we keep from a response
+#define	SOAP_ARG_LENGTH		32
+#define	SOAP_TIMEOUT		5000	// ms, default per request
+#define	SOAP_IDLE_TIMEOUT	15000	// ms, close a kept-alive connection after this
+
+// Status passed to the callback when there's no HTTP status
+#define	SOAP_ERROR_TIMEOUT	-1
+#define	SOAP_ERROR_CONNECT	-2
+#define	SOAP_ERROR_CLOSED	-3
+
+struct SOAPResult {
+  int	nargs;
+  char	name[SOAP_MAX_ARGS][SOAP_ARG_LENGTH];
+  char	value[SOAP_MAX_ARGS][SOAP_ARG_LENGTH];
+};
+
+// Status is the HTTP status (200 is ok), or a SOAP_ERROR_*. Result may be NULL.
+typedef std::function<void(int id, int status, struct SOAPResult *result)> SOAPCallback;
+
+class SOAPClient {
+  public:
+    SOAPClient();
+    ~SOAPClient();
+
+    int Invoke(const char *controlURL, const char *serviceType, const char *action,
+      const char *args, SOAPCallback cb, unsigned long timeout = SOAP_TIMEOUT);
+    int pending();
+    void periodic();
+
+    static const char *Argument(struct SOAPResult *result, const char *name);
+
+  private:
+    struct Request {
+      int		id;		// 0 : free
+      IPAddress		ip;
+      uint16_t		port;
+      char		*message;	// The complete HTTP request
+      int		len;
+      unsigned long	deadline;
+      bool		sent;
+      SOAPCallback	cb;
+    } requests[SOAP_MAX_REQUESTS];
+    int nextid;
+
+    /*
+     * Connections stay open as long as the server lets them, and are reused for
+     * the next request to the same host:port. Responses are parsed as they come in.
+     */
+    struct Connection {
+      WiFiClient	client;
+      IPAddress		ip;
+      uint16_t		port;
+      struct Request	*req;		// NULL : idle
+      unsigned long	idle;		// millis() when the last response completed
+      uint8_t		state;		// Status line, headers, body
+      bool		keepalive;
+      int		status;
+      int		remaining;	// Content-Length still to read, -1 : until close
+      int		depth;		// Of the XML element we're in
+      uint8_t		linelen;
+      char		line[80];	// Header line, or XML tag
+      uint8_t		textlen;
+      bool		inTag, capture;
+      struct SOAPResult	result;
+    } connections[SOAP_MAX_CONNECTIONS];
+
+    bool Start(struct Request *req);
+    void Complete(struct Connection *c, int status);
+    void Free(struct Request *req);
+    void Parse(struct Connection *c, const char *buf, int len);
+    void Header(struct Connection *c);
+    void Element(struct Connection *c);
+};
+
+#endif /* _INCLUDE_SOAP_CLIENT_H_ */
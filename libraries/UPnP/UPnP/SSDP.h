@@ -34,9 +34,18 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <WiFiUdp.h>
+#include <functional>
+#include "UPnP/SSDPParser.h"
 
 class UdpContext;
 
+/*
+ * SSDPClass owns the SSDP socket. Other parts (e.g. DiscoveryManager, a control point)
+ * register a consumer to see every datagram received on it, after parsing.
+ */
+typedef std::function<void(SSDPMessage &msg, uint32_t addr, uint16_t port)> SSDPConsumer;
+#define SSDP_MAX_CONSUMERS	2
+
 typedef enum {
   NONE,
   SEARCH,
@@ -45,26 +54,105 @@ typedef enum {
 
 struct SSDPTimer;
 
+/*
+ * M-SEARCH replies waiting for their random delay (within MX) to expire.
+ * One entry per search (not per reply) : an ssdp:all needs 3 + nservices replies.
+ */
+#define SSDP_REPLY_QUEUE_SIZE	8
+
+// Search targets we answer for. Services are SSDP_TARGET_SERVICE + their index.
+#define SSDP_TARGET_ROOTDEVICE	0
+#define SSDP_TARGET_UUID	1
+#define SSDP_TARGET_DEVICE	2
+#define SSDP_TARGET_SERVICE	3
+
+// Pre-rendered packets, per target
+#define SSDP_PACKET_RESPONSE	0	// Reply to M-SEARCH
+#define SSDP_PACKET_ALIVE	1	// NOTIFY ssdp:alive
+#define SSDP_PACKET_BYEBYE	2	// NOTIFY ssdp:byebye
+#define SSDP_PACKET_TYPES	3
+
+/*
+ * Datagrams received, waiting for SSDPClass::periodic(). M-SEARCH and NOTIFY
+ * messages are only a few hundred bytes, larger ones are not for us.
+ */
+#define SSDP_RING_SIZE		4	// Power of two
+#define SSDP_RING_SLOT		512
+
+typedef struct {
+  uint32_t addr;
+  uint16_t port;
+  uint16_t len;
+  char data[SSDP_RING_SLOT];	// One byte extra for the parser
+} SSDPDatagram;
+
+typedef struct {
+  uint32_t addr;
+  uint16_t port;
+  uint32_t targets;		// Bitmask of targets still to answer
+  unsigned long due;		// millis() of the next reply
+  unsigned long end;		// millis() when the MX window closes
+} SSDPReply;
+
 class SSDPClass {
   public:
     SSDPClass();
     ~SSDPClass();
 
     bool begin(UPnPDevice &device);
+    bool listen();
+    bool addConsumer(SSDPConsumer consumer);
+    void multicast(const char *packet, int len);
+    void unicast(const char *packet, int len, uint32_t addr, uint16_t port);
+    void periodic();
+    uint32_t getDropped();
+    const char *getUuid();
+    uint32_t getOverflows();
+    void invalidate();
+    void byebye();
+    void SendEvent(const char *serviceType, const char *serviceId, const char *level,
+      uint32_t seq, const char *body, int bodylen);
 
   protected:
-    void _send(ssdp_method_t method);
+    void _sendPacket(int type, int target, uint32_t addr, uint16_t port);
+    const char *_targetName(int target, const char *&prefix);
+    void _render();
     void _update();
+    void _search(const char *st, const char *mx);
+    void _queueReply(uint32_t targets, unsigned long window);
+    void _sendReply(SSDPReply *r);
+    void _sendReplies();
     void _startTimer();
     static void _onTimerStatic(SSDPClass* self);
 
     UdpContext* _server;
+    UdpContext* _event;		// UPnP 1.1 multicast eventing
+    UdpContext* _setupMulticast(IPAddress group, uint16_t port, bool join);
+    uint32_t _bootid;
+
+    char **_packets;		// [target * SSDP_PACKET_TYPES + type]
+    int *_packetlen;
+    int _ntargets;
+    uint32_t _renderedIp, _renderedBootid;
+    uint16_t _renderedPort;
+    bool _stale;
     SSDPTimer* _timer;
 
     IPAddress _respondToAddr;
     uint16_t  _respondToPort;
 
-    bool _pending;
+    SSDPDatagram _ring[SSDP_RING_SIZE];
+    volatile uint8_t _ringHead;	// Written only by _update()
+    volatile uint8_t _ringTail;	// Written only by periodic()
+    uint32_t _overflows;	// Datagrams lost because the ring was full
+    uint32_t _oversize;		// Datagrams too large for a ring slot
+
+    bool _device;		// Play the device role : announce, answer M-SEARCH
+    SSDPConsumer _consumers[SSDP_MAX_CONSUMERS];
+    int _nconsumers;
+    SSDPReply _replies[SSDP_REPLY_QUEUE_SIZE];
+    int _nreplies;
+    uint32_t _dropped;		// Searches (or answers to them) we couldn't handle
     unsigned short _delay;
     unsigned long _process_time;
     unsigned long _notify_time;
@@ -74,7 +162,13 @@ class SSDPClass {
   private:
     UPnPDevice device;
     void RegisterNotify();
-    void EverySecond();
+    void _tick();
+    bool _join();
+    uint32_t _announcedIp;
+    volatile bool _rejoin;	// Set by _tick(), done from periodic()
+    int _burst;			// Next announcement to send, -1 if none
+    unsigned long _burstDue;	// millis() when the burst (or its next repetition) may go on
+    void _startBurst(unsigned long spread);
 };
 
 extern SSDPClass SSDP;
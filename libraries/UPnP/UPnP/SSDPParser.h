@@ -0,0 +1,70 @@
+/*
+ * Single pass tokenizer for SSDP datagrams, shared by SSDPClass and DiscoveryManager.
+ *
+ * Copyright (c) 2016 Danny Backx
+ * 
+ * License (MIT license):
+ *   Permission is hereby granted, free of charge, to any person obtaining a copy
+ *   of this software and associated documentation files (the "Software"), to deal
+ *   in the Software without restriction, including without limitation the rights
+ *   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *   copies of the Software, and to permit persons to whom the Software is
+ *   furnished to do so, subject to the following conditions:
+ * 
+ *   The above copyright notice and this permission notice shall be included in
+ *   all copies or substantial portions of the Software.
+ * 
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *   THE SOFTWARE.
+ */
+
+#ifndef _UPNP_SSDP_PARSER_H_
+#define _UPNP_SSDP_PARSER_H_
+
+typedef enum {
+  SSDP_MSG_UNKNOWN,
+  SSDP_MSG_MSEARCH,		// M-SEARCH * HTTP/1.1
+  SSDP_MSG_NOTIFY,		// NOTIFY * HTTP/1.1
+  SSDP_MSG_RESPONSE		// HTTP/1.1 200 OK
+} ssdp_message_t;
+
+// The headers we care about, index in SSDPMessage::value
+typedef enum {
+  SSDP_HDR_BOOTID,		// BOOTID.UPNP.ORG
+  SSDP_HDR_CACHE_CONTROL,
+  SSDP_HDR_EXT,
+  SSDP_HDR_LOCATION,
+  SSDP_HDR_MAN,
+  SSDP_HDR_MX,
+  SSDP_HDR_NT,
+  SSDP_HDR_NTS,
+  SSDP_HDR_SERVER,
+  SSDP_HDR_ST,
+  SSDP_HDR_USN,
+  SSDP_HEADERS
+} ssdp_header_t;
+
+/*
+ * Values point into the buffer passed to SSDPParse, without the header name
+ * and surrounding blanks. NULL for headers that were not in the message.
+ */
+typedef struct {
+  ssdp_message_t type;
+  const char *value[SSDP_HEADERS];
+} SSDPMessage;
+
+/*
+ * Cut the datagram into lines and pick up the headers. The buffer is modified
+ * (values are terminated, so it needs room for one byte after len), and must
+ * stay around as long as the result is used.
+ * Nothing static is used, so this can be called from the lwIP receive callback
+ * and from the main loop at the same time.
+ */
+ssdp_message_t SSDPParse(char *buffer, int len, SSDPMessage *msg);
+
+#endif
@@ -24,9 +24,21 @@
 #ifndef	__StateVariable_H_
 #define	__StateVariable_H_
 
+#define	STATEVAR_VALUE_LENGTH	32	// Including the terminating null, longer values are refused
+
+// Event priority classes, see UPnPService::setEventPriority()
+#define	EVENT_PRIORITY_HIGH	0
+#define	EVENT_PRIORITY_NORMAL	1
+#define	EVENT_LANES		2
+
 typedef struct {
   const char *name, *dataType;
   boolean sendEvents;
+  uint32_t subscribers;		// Bitmask of subscriber slots watching this variable
+  char value[STATEVAR_VALUE_LENGTH];	// Last value reported, for the initial event
+  const char *multicast;	// UPnP 1.1 multicast event level (e.g. "upnp:info"), or NULL
+  uint8_t priority;		// EVENT_PRIORITY_*
+  unsigned long queuedAt;	// millis() when its event was queued
 } StateVariable;
 
 #endif
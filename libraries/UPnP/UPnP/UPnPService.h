@@ -36,10 +36,24 @@
 #define	N_VARIABLES			4
 #define	SUBSCRIBER_ALLOC_INCREMENT	4
 
+// Subscribers and state variables are indexed by bitmasks (uint32_t), see StateVariable.h
+#define	MAX_VARIABLES			32
+#define	MAX_SUBSCRIBERS			32
+
+// Number of events remembered per service, for /<service>/events?since=N
+#define	EVENT_JOURNAL_SIZE		16
+
 class UPnPService;
 typedef void (UPnPService::*MemberActionFunction)();
 typedef void (*ActionFunction)();
 
+typedef struct {
+  uint32_t seq;			// 0 : unused
+  uint32_t timestamp;		// Seconds
+  int variable;			// Index in UPnPService::variables
+  char value[STATEVAR_VALUE_LENGTH];
+} JournalEntry;
+
 typedef struct {
   const char *name;
   UPnPService *sensor;
@@ -61,17 +75,22 @@ class UPnPService {
     void addAction(const char *name, MemberActionFunction handler, const char *xml);
 
     // Define a state variable
-    void addStateVariable(const char *name, const char *datatype, boolean sendEvents);
+    bool addStateVariable(const char *name, const char *datatype, boolean sendEvents);
+    void setMulticastEvents(const char *name, const char *level);
+    void setEventPriority(const char *name, int priority);
     void VariableChanged(const char *name, const char *value);
     char *getActionListXML();
     char *getStateVariableListXML();
     char *getServiceXML();
     void begin(Configuration *config);
     Action *findAction(const char *);
-    StateVariable *lookupVariable(char *name);
+    StateVariable *lookupVariable(const char *name);
+    int lookupVariableIndex(const char *name);
 
     // static void EventHandler();
     void EventHandler();
+    void JournalHandler();
+    void SubscribersHandler();
     static void ControlHandler();
 
     int nvariables, maxvariables;
@@ -86,14 +105,23 @@ class UPnPService {
 
     UPnPSubscriber *Subscribe();
     void Subscribe(UPnPSubscriber *ns);
+    void Renew();
+    void SubscribeReply(UPnPSubscriber *sp);
     void Unsubscribe();
     void Unsubscribe(char *uuid);
     void Unsubscribe(UPnPSubscriber *sp);
+    UPnPSubscriber *FindSubscriber(const char *sid);
 
     void SendNotify(UPnPSubscriber *s, const char *varName);
     void SendNotify();
     // void SendNotify(StateVariable &sv);
     void SendNotify(const char *varName);
+    bool SendNotify(const char *varName, const char *value);
+
+    void SendInitialEvents();
+    void ExpireSubscribers();
+    void PollSubscribers();
+    int SendQueuedEvents(int lane, int max);
 
     void SendSCPD(WiFiClient client);
     void ReadConfiguration(const char *name, Configuration *config);
@@ -101,8 +129,25 @@ class UPnPService {
   private:
     UPnPSubscriber **subscriber;
     int nsubscribers, maxsubscribers;
-    int ReadLine(File f);
-    char *line;
+    char *RenderNotifyBody(const char *varName, const char *value, int &len);
+    char *RenderSnapshot(uint32_t mask, int &len);
+
+    uint32_t pending;		// Subscriber slots still waiting for their initial event
+    char *snapshot;		// Initial event body, valid until a variable changes
+    int snapshotlen;
+    uint32_t snapshotmask;
+
+    JournalEntry journal[EVENT_JOURNAL_SIZE];	// Ring buffer, indexed by seq
+    uint32_t journalseq;			// Last seq recorded
+    void Journal(int ix, const char *value);
+
+    uint32_t multicastseq;	// SEQ of multicast events, per service
+
+    uint32_t queued[EVENT_LANES];	// Bitmask of variables with an event to send, per priority
+    uint32_t lanecount[EVENT_LANES], lanetotal[EVENT_LANES], lanemax[EVENT_LANES];	// Queueing delay (ms)
+    void SendEvent(int ix);
+    void Deliver(int slot, uint32_t vars, const char *body, int len);
+    void Drop(UPnPSubscriber *s);
 
     Configuration *config;
 
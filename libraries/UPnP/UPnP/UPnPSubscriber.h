@@ -27,6 +27,25 @@
 #include "UPnP/UPnPService.h"
 #include "UPnP/StateVariable.h"
 
+#define	STATEVAR_NAME_LENGTH	32
+
+/*
+ * Circuit breaker on event delivery : after SUBSCRIBER_OPEN_FAILURES consecutive
+ * failures, stop trying. Probe again after SUBSCRIBER_BACKOFF_MIN ms, doubling up to
+ * SUBSCRIBER_BACKOFF_MAX. After SUBSCRIBER_DROP_FAILURES, drop the subscription.
+ */
+#define	SUBSCRIBER_OPEN_FAILURES	3
+#define	SUBSCRIBER_DROP_FAILURES	10
+#define	SUBSCRIBER_BACKOFF_MIN		5000
+#define	SUBSCRIBER_BACKOFF_MAX		300000
+
+// Wait this long (ms) for the status of the reply to a NOTIFY, it's read from Poll()
+#define	SUBSCRIBER_REPLY_TIMEOUT	1000
+
+// Subscription duration (s) granted if none or "infinite" is asked, and the maximum
+#define	SUBSCRIBER_TIMEOUT_DEFAULT	1800
+#define	SUBSCRIBER_TIMEOUT_MAX		86400
+
 class UPnPService;
 class UPnPSubscriber {
 public:
@@ -34,14 +53,26 @@ public:
   const char *host, *path;
   int port;
 
-  int timeout;
-  StateVariable **variables;	// List of variables watched
-  int nvariables;
+  int timeout;			// Seconds, as granted
+  unsigned long expires;	// millis() when the subscription ends, unless renewed
+  uint32_t variables;		// Bitmask of variables watched, by index in the UPnPService
   char *sid;			// Subscription UUID
   int seq;			// Sequence number
 
-  void SendNotify(StateVariable &sv);
-  void SendNotify(const char *varName);
+  bool SendNotify(const char *body, int bodylen);
+  bool Poll();
+  bool busy();
+  uint32_t owed;		// Variables that changed while busy, see UPnPService::Deliver
+
+  // Delivery statistics
+  int failures;			// Consecutive failed deliveries
+  uint32_t rtt;			// Time (ms) the last successful delivery took
+  uint32_t sent;		// Bytes delivered
+  uint32_t unsent;		// Bytes of events not delivered
+  unsigned long probe;		// millis() of the next attempt, while the breaker is open
+  uint32_t backoff;
+  bool isOpen();
+  bool expired();
 
   WebClient *wc;
   UPnPSubscriber(UPnPService *s);
@@ -57,6 +88,18 @@ public:
 protected:
   UPnPService *service;
 
+private:
+  char *header;			// Pre-rendered NOTIFY header, up to the SEQ value
+  int headerlen;
+  void RenderHeader();
+
+  // The NOTIFY in progress, waiting for its reply
+  bool inprogress;
+  unsigned long start, deadline;
+  int linelen;
+  char line[32];		// Status line of the reply
+  bool Done(int status);
+
 };
 
 #endif
@@ -25,6 +25,10 @@
 #include <functional>
 #include "UPnP/HTTP.h"
 
+// Remember host name lookups, see WebClient::resolve()
+#define	WEBCLIENT_DNS_CACHE	8
+#define	WEBCLIENT_DNS_TTL	600000	// ms
+
 class WebClient
 {
 public:
@@ -39,8 +43,15 @@ public:
   bool connect(IPAddress ip, uint16_t port);
   char *send(const char *mime, const char *msg);
   char *send(char *msg);
+  size_t send(int nparts, const char **parts, const int *lens);
+  bool connected();
+  int status(char *line, int size, int &len);
+  void stop();
   void setMethod(enum HTTPMethod);
 
+  static bool resolve(const char *host, IPAddress &ip);
+  static bool parseURL(const char *url, char *host, int hostlen, uint16_t &port, const char *&path);
+
 private:
   char *host;
   const char *path;
@@ -106,6 +106,7 @@ protected:
   void _addRequestHandler(WebRequestHandler* handler);
   void _handleRequest();
   bool _parseRequest(WiFiClient& client);
+  void _parseArguments(String data);
   static const char* _responseCodeToString(int code);
   bool _parseForm(WiFiClient& client, String boundary, uint32_t len);
   void _uploadWriteByte(uint8_t b);
@@ -70,6 +70,7 @@ void UPnPDisplay::begin() {
   config = new Configuration("Display",
     new ConfigurationItem("message", ""),
     NULL);
+  config->Load();
 
   DEBUG.printf("UPnPDisplay ...\n");
 
@@ -30,6 +30,12 @@
 #include "UPnP/Headers.h"
 #include "UPnP/Configuration.h"
 
+#ifdef ENABLE_SNTP
+extern "C" {
+#include <sntp.h>
+}
+#endif
+
 #undef	UPNP_DEBUG
 // #define	UPNP_DEBUG Serial
 
@@ -39,6 +45,8 @@ static const char *_description_xml = "/description.xml";
 static const char *_scpd_xml = "scpd.xml";
 static const char *_control_xml = "control";
 static const char *_event_xml = "event";
+static const char *_events_url = "events";
+static const char *_subscribers_url = "subscribers";
 
 static const char *_get_service_xml_template =
   "<service>"
@@ -49,6 +57,21 @@ static const char *_get_service_xml_template =
     "<SCPDURL>/%s/%s</SCPDURL>"
   "</service>";
 
+// An event body is the header, one property per variable, and the trailer.
+static const char *_notify_body_header =
+  "<?xml version=\"1.0\"?>\r\n"
+  "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\r\n"
+  ;
+// Parameters : variable name, value, variable name
+static const char *_notify_property_template =
+  "<e:property>\r\n"
+  "<%s>%s</%s>\r\n"
+  "</e:property>\r\n"
+  ;
+static const char *_notify_body_trailer =
+  "</e:propertyset>\r\n"
+  ;
+
 static const char *_upnp_scpd_template =
   "<?xml version=\"1.0\"?>"
   "<scpd xmlns=\"urn:danny-backx-info:service-1-0\">"
@@ -74,7 +97,16 @@ UPnPService::UPnPService() {
   maxvariables = nvariables = 0;
   variables = NULL;
 
-  line = NULL;
+  pending = 0;
+  snapshot = NULL;
+  snapshotlen = 0;
+  snapshotmask = 0;
+
+  journalseq = 0;
+  multicastseq = 0;
+  for (int i=0; i<EVENT_LANES; i++)
+    queued[i] = lanecount[i] = lanetotal[i] = lanemax[i] = 0;
+  memset(journal, 0, sizeof(journal));
 
   this->serviceName = NULL;
   this->serviceType = NULL;
@@ -94,7 +126,16 @@ UPnPService::UPnPService(const char *name, const char *serviceType, const char *
   maxvariables = nvariables = 0;
   variables = NULL;
 
-  line = NULL;
+  pending = 0;
+  snapshot = NULL;
+  snapshotlen = 0;
+  snapshotmask = 0;
+
+  journalseq = 0;
+  multicastseq = 0;
+  for (int i=0; i<EVENT_LANES; i++)
+    queued[i] = lanecount[i] = lanetotal[i] = lanemax[i] = 0;
+  memset(journal, 0, sizeof(journal));
 
   this->serviceName = name;
   this->serviceType = serviceType;
@@ -112,8 +153,8 @@ UPnPService::~UPnPService() {
       free(variables[i]);
   free(variables);
 
-  if (line)
-    free(line);
+  if (snapshot)
+    free(snapshot);
 
   delete subscriber;
 }
@@ -147,10 +188,22 @@ void UPnPService::addAction(const char *name, ActionFunction handler, const char
   nactions++;
 }
 
-void UPnPService::addStateVariable(const char *name, const char *datatype, boolean sendEvents) {
+/*
+ * Returns false if the variable can't be added : subscriber bitmasks index at most
+ * MAX_VARIABLES of them.
+ */
+bool UPnPService::addStateVariable(const char *name, const char *datatype, boolean sendEvents) {
 #ifdef UPNP_DEBUGx
   UPNP_DEBUG.printf("UPnPService UPnPService::addStateVariable %s\n", name);
 #endif
+  if (nvariables == MAX_VARIABLES) {
+#ifdef UPNP_DEBUG
+    UPNP_DEBUG.printf("UPnPService::addStateVariable(%s) : more than %d variables\n",
+      name, MAX_VARIABLES);
+#endif
+    return false;
+  }
+
   if (nvariables == maxvariables) {
     maxvariables += N_VARIABLES;
     variables = (StateVariable **)realloc(variables, maxvariables * sizeof(StateVariable *));;
@@ -163,6 +216,33 @@ void UPnPService::addStateVariable(const char *name, const char *datatype, boole
   sv->name = name;
   sv->dataType = datatype;
   sv->sendEvents = sendEvents;
+  sv->subscribers = 0;
+  sv->value[0] = 0;
+  sv->multicast = NULL;
+  sv->priority = EVENT_PRIORITY_NORMAL;
+  sv->queuedAt = 0;
+  return true;
+}
+
+/*
+ * Also send changes of this variable as UPnP 1.1 multicast events, so any number
+ * of listeners get them in one datagram. Level is one of the LVL values from the
+ * UPnP architecture, e.g. "upnp:emergency", "upnp:warning", "upnp:info".
+ */
+void UPnPService::setMulticastEvents(const char *name, const char *level) {
+  StateVariable *sv = lookupVariable(name);
+  if (sv)
+    sv->multicast = level;
+}
+
+/*
+ * Events of EVENT_PRIORITY_HIGH variables (e.g. an alarm) are all sent before any
+ * EVENT_PRIORITY_NORMAL one (telemetry), see UPnPClass::periodic().
+ */
+void UPnPService::setEventPriority(const char *name, int priority) {
+  StateVariable *sv = lookupVariable(name);
+  if (sv && priority >= 0 && priority < EVENT_LANES)
+    sv->priority = priority;
 }
 
 // Caller must free return pointer
@@ -283,10 +363,12 @@ void UPnPService::ControlHandler() {
 #endif
   const char *body1 = strstr(msg, "<s:Body>");
   const char *body2 = strstr(msg, "</s:Body>");
-  if (body2 < body1)
+  if (body1 == NULL || body2 == NULL || body2 < body1)
     return;	// Silently return
 
   body1 += 8;	// bypass <s:Body>
+  while (body1 < body2 && isspace(*body1))
+    body1++;	// Clients may put the action on a line of its own
   int bodylen = (body2 - body1);
   char *xml = (char *)malloc(bodylen+1);
   strncpy(xml, body1, bodylen);
@@ -313,7 +395,11 @@ void UPnPService::ControlHandler() {
   UPNP_DEBUGmem.print("GetFreeHeap : "); UPNP_DEBUG.println(ESP.getFreeHeap());
 #endif
 
-  Action *pAction = srv->findAction(action);
+  // Several services may share the web server : the URL tells which one this is for
+  UPnPService *service = UPnP.FindService(HTTP.httpUri());
+  if (service == NULL)
+    service = srv;
+  Action *pAction = service->findAction(action);
   free(action);
   if (pAction == 0)
     return;
@@ -371,6 +457,24 @@ void UPnPService::begin(Configuration *cfg) {
 #endif
   free(url);
 
+  len = strlen(_events_url) + 3 + strlen(serviceName);
+  url = (char *)malloc(len);
+  sprintf(url, "/%s/%s", serviceName, _events_url);
+  HTTP.on(url, HTTP_GET, staticJournalHandler);
+#ifdef UPNP_DEBUG
+  UPNP_DEBUG.printf("UPnPService::begin(%s)\n", url); 
+#endif
+  free(url);
+
+  len = strlen(_subscribers_url) + 3 + strlen(serviceName);
+  url = (char *)malloc(len);
+  sprintf(url, "/%s/%s", serviceName, _subscribers_url);
+  HTTP.on(url, HTTP_GET, staticSubscribersHandler);
+#ifdef UPNP_DEBUG
+  UPNP_DEBUG.printf("UPnPService::begin(%s)\n", url); 
+#endif
+  free(url);
+
   srv = this;
 
   // Configuration
@@ -380,26 +484,333 @@ void UPnPService::begin(Configuration *cfg) {
   }
 }
 
+void UPnPService::VariableChanged(const char *name, const char *value) {
+  SendNotify(name, value);
+}
+
 void UPnPService::SendNotify(const char *varName) {
+  SendNotify(varName, NULL);
+}
+
+// Caller must free the result
+char *UPnPService::RenderNotifyBody(const char *varName, const char *value, int &len) {
+  if (value == NULL)
+    value = "";
+  char *body = (char *)malloc(strlen(_notify_body_header) + strlen(_notify_property_template)
+    + 2 * strlen(varName) + strlen(value) + strlen(_notify_body_trailer));
+  len = sprintf(body, "%s", _notify_body_header);
+  len += sprintf(body + len, _notify_property_template, varName, value, varName);
+  len += sprintf(body + len, "%s", _notify_body_trailer);
+  return body;
+}
+
+/*
+ * An event body with the current value of all variables in the mask.
+ * Caller must free the result.
+ */
+char *UPnPService::RenderSnapshot(uint32_t mask, int &len) {
+  int i, l = strlen(_notify_body_header) + strlen(_notify_body_trailer) + 1;
+  for (i=0; i<nvariables; i++)
+    if (mask & (1U << i))
+      l += strlen(_notify_property_template) + 2 * strlen(variables[i]->name) + strlen(variables[i]->value);
+
+  char *body = (char *)malloc(l);
+  len = sprintf(body, "%s", _notify_body_header);
+  for (i=0; i<nvariables; i++)
+    if (mask & (1U << i))
+      len += sprintf(body + len, _notify_property_template,
+        variables[i]->name, variables[i]->value, variables[i]->name);
+  len += sprintf(body + len, "%s", _notify_body_trailer);
+  return body;
+}
+
+/*
+ * Events are not sent from here, but queued per priority class and sent from
+ * UPnPClass::periodic(). This way a slow subscriber to telemetry can't hold up an alarm.
+ * A variable is queued only once : if it changes again before being sent,
+ * its subscribers only get the latest value.
+ *
+ * The value is kept (for initial events, the journal and the snapshot) in a buffer of
+ * STATEVAR_VALUE_LENGTH. Longer values are refused rather than cut : returns false.
+ */
+bool UPnPService::SendNotify(const char *varName, const char *value) {
+  int ix = lookupVariableIndex(varName);
+  if (ix < 0)
+    return false;
+  if (value == NULL)
+    value = "";
+  if (strlen(value) >= STATEVAR_VALUE_LENGTH) {
+#ifdef UPNP_DEBUG
+    UPNP_DEBUG.printf("UPnPService::SendNotify(%s) : value too long (%d)\n", varName, strlen(value));
+#endif
+    return false;
+  }
+
+  // Remember the value for initial events, and invalidate the one we had
+  strcpy(variables[ix]->value, value);
+  if (snapshot) {
+    free(snapshot);
+    snapshot = NULL;
+  }
+  Journal(ix, variables[ix]->value);
+
+  StateVariable *sv = variables[ix];
+  if ((queued[sv->priority] & (1U << ix)) == 0) {
+    queued[sv->priority] |= (1U << ix);
+    sv->queuedAt = millis();
+  }
+  return true;
+}
+
+/*
+ * Send at most max events from this priority class, oldest first.
+ * Returns the number of events sent.
+ */
+int UPnPService::SendQueuedEvents(int lane, int max) {
+  int n;
+
+  for (n=0; n<max && queued[lane]; n++) {
+    int ix = -1;
+    for (uint32_t mask = queued[lane]; mask; mask &= mask - 1) {
+      int i = __builtin_ctz(mask);
+      if (ix < 0 || (long)(variables[i]->queuedAt - variables[ix]->queuedAt) < 0)
+        ix = i;
+    }
+    queued[lane] &= ~(1U << ix);
+
+    uint32_t delay = millis() - variables[ix]->queuedAt;
+    lanecount[lane]++;
+    lanetotal[lane] += delay;
+    if (delay > lanemax[lane])
+      lanemax[lane] = delay;
+
+    SendEvent(ix);
+  }
+  return n;
+}
+
+/*
+ * Only the subscribers watching this variable get notified.
+ * The variable keeps a bitmask of their slots, so we don't need to look at the others.
+ * The event body is rendered once, and shared by all of them.
+ */
+void UPnPService::SendEvent(int ix) {
+  const char *varName = variables[ix]->name;
+
+  // Subscribers still waiting for their initial event will get the new value in it.
+  uint32_t mask = variables[ix]->subscribers & ~pending;
+  if (mask == 0 && variables[ix]->multicast == NULL)
+    return;
 #ifdef UPNP_DEBUG
-  UPNP_DEBUG.printf("UPnPService::SendNotify(%s), %d\n", varName, nsubscribers); 
+  uint32_t cycles = ESP.getCycleCount();
 #endif
-  for (int i=0; i < nsubscribers; i++) {
+
+  int len;
+  char *body = RenderNotifyBody(varName, variables[ix]->value, len);
+  if (variables[ix]->multicast)
+    SSDP.SendEvent(serviceType, serviceId, variables[ix]->multicast, multicastseq++, body, len);
+  while (mask) {
+    int i = __builtin_ctz(mask);
+    mask &= mask - 1;
+    Deliver(i, 1U << ix, body, len);
+  }
+  free(body);
+
+#ifdef UPNP_DEBUG
+  cycles = ESP.getCycleCount() - cycles;
+  UPNP_DEBUG.printf("UPnPService::SendEvent(%s), %d subscribers, %u cycles\n", varName, nsubscribers, cycles); 
+#endif
+}
+
+/*
+ * Send the SEQ 0 event to new subscribers. This is not done from Subscribe() because
+ * the reply to SUBSCRIBE has to go out first, and it shouldn't hold up the web server.
+ *
+ * When a lot of control points subscribe at the same time (e.g. after a power cut),
+ * they typically all watch the same variables : the snapshot is rendered only once.
+ */
+void UPnPService::SendInitialEvents() {
+  uint32_t mask = pending;
+  pending = 0;
+
+  uint32_t evented = 0;
+  for (int i=0; i<nvariables; i++)
+    if (variables[i]->sendEvents)
+      evented |= (1U << i);
+
+  while (mask) {
+    int i = __builtin_ctz(mask);
+    mask &= mask - 1;
     UPnPSubscriber *s = subscriber[i];
-    s->SendNotify(varName);
+    if (s == NULL)
+      continue;
+
+    uint32_t vm = s->variables & evented;
+    if (snapshot == NULL || snapshotmask != vm) {
+      if (snapshot)
+        free(snapshot);
+      snapshot = RenderSnapshot(vm, snapshotlen);
+      snapshotmask = vm;
+    }
+#ifdef UPNP_DEBUG
+    UPNP_DEBUG.printf("UPnPService::SendInitialEvents(%s) -> slot %d\n", serviceName, i); 
+#endif
+    Deliver(i, vm, snapshot, snapshotlen);
   }
 }
 
+/*
+ * Send an event (about the variables in vars) to one subscriber, drop the subscription
+ * if its callback has stopped answering for good (see UPnPSubscriber::SendNotify).
+ * While its previous NOTIFY is still waiting for a reply, the subscriber only
+ * remembers the variables : it gets their latest values after, see PollSubscribers().
+ */
+void UPnPService::Deliver(int slot, uint32_t vars, const char *body, int len) {
+  UPnPSubscriber *s = subscriber[slot];
+  if (s->busy()) {
+    s->owed |= vars;
+    return;
+  }
+  if (! s->SendNotify(body, len))
+    Drop(s);
+}
+
+void UPnPService::Drop(UPnPSubscriber *s) {
+#ifdef UPNP_DEBUG
+  UPNP_DEBUG.printf("UPnPService(%s) : dropping %s\n", serviceName, s->getSID()); 
+#endif
+  Unsubscribe(s);
+  delete s;
+}
+
+/*
+ * Pick up the replies to NOTIFYs in progress, called from UPnPClass::periodic().
+ * Subscribers that were busy when variables changed get them now, in one event.
+ */
+void UPnPService::PollSubscribers() {
+  if (nsubscribers == 0)
+    return;
+  for (int i=0; i<maxsubscribers; i++) {
+    UPnPSubscriber *s = subscriber[i];
+    if (s == NULL)
+      continue;
+    if (! s->Poll()) {
+      Drop(s);
+      continue;
+    }
+    uint32_t vm = s->owed & s->variables;
+    if (s->busy() || vm == 0)
+      continue;
+    s->owed = 0;
+
+    int len;
+    char *body = RenderSnapshot(vm, len);
+    Deliver(i, vm, body, len);
+    free(body);
+  }
+}
+
+/*
+ * GET /<service>/subscribers : delivery statistics, one line per subscription :
+ *   <sid> <ok|open> <consecutive failures> <last rtt ms> <bytes sent> <bytes not sent> <callback url>
+ */
+void UPnPService::SubscribersHandler() {
+  int len = 1;
+  for (int i=0; i<maxsubscribers; i++)
+    if (subscriber[i])
+      len += 80 + strlen(subscriber[i]->getSID()) + (subscriber[i]->url ? strlen(subscriber[i]->url) : 0);
+
+  char *r = (char *)malloc(len);
+  len = 0;
+  r[0] = 0;
+  for (int i=0; i<maxsubscribers; i++) {
+    UPnPSubscriber *s = subscriber[i];
+    if (s == NULL)
+      continue;
+    len += sprintf(r + len, "%s %s %d %u %u %u %s\n", s->getSID(), s->isOpen() ? "open" : "ok",
+      s->failures, s->rtt, s->sent, s->unsent, s->url ? s->url : "-");
+  }
+
+  HTTP.send(200, UPnPClass::mimeTypeText, r);
+  free(r);
+}
+
 void UPnPService::SendNotify(UPnPSubscriber *s, const char *varName) {
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("UPnPService::SendNotify(_, %s)\n", varName); 
 #endif
-  s->SendNotify(varName);
+  int len;
+  char *body = RenderNotifyBody(varName, NULL, len);
+  s->SendNotify(body, len);
+  free(body);
+}
+
+/*
+ * Remember this event, overwriting the oldest one.
+ */
+void UPnPService::Journal(int ix, const char *value) {
+  JournalEntry *e = &journal[++journalseq % EVENT_JOURNAL_SIZE];
+
+  e->seq = journalseq;
+#ifdef ENABLE_SNTP
+  e->timestamp = sntp_get_current_timestamp();
+#else
+  e->timestamp = millis() / 1000;
+#endif
+  e->variable = ix;
+  strcpy(e->value, value);
+}
+
+/*
+ * GET /<service>/events?since=N
+ *
+ * Lets a control point that missed events (or doesn't subscribe at all) catch up
+ * with one request. The reply is plain text, one line per event :
+ *   seq 42			last event recorded
+ *   gap 27			only if events after N were overwritten; 27 is the oldest one left
+ *   27 1476871234 Temperature 21.50
+ *   ...
+ * Upon a gap, the caller should query the full state instead.
+ * The queueing delay of each priority class is reported as
+ *   lane 0 12 3 40		priority, events sent, average and maximum delay (ms)
+ */
+void UPnPService::JournalHandler() {
+  uint32_t since = HTTP.arg("since").toInt();
+  uint32_t oldest = (journalseq > EVENT_JOURNAL_SIZE) ? journalseq - EVENT_JOURNAL_SIZE + 1 : 1;
+
+  if (since + 1 < oldest)
+    since = oldest - 1;
+  else
+    oldest = 0;
+  if (since > journalseq)
+    since = journalseq;
+
+  int len = 32 + EVENT_LANES * 48;
+  for (uint32_t seq = since + 1; seq <= journalseq; seq++) {
+    JournalEntry *e = &journal[seq % EVENT_JOURNAL_SIZE];
+    len += 24 + strlen(variables[e->variable]->name) + strlen(e->value);
+  }
+
+  char *r = (char *)malloc(len);
+  len = sprintf(r, "seq %u\n", journalseq);
+  if (oldest)
+    len += sprintf(r + len, "gap %u\n", oldest);
+  for (int i=0; i<EVENT_LANES; i++)
+    len += sprintf(r + len, "lane %d %u %u %u\n", i, lanecount[i],
+      lanecount[i] ? lanetotal[i] / lanecount[i] : 0, lanemax[i]);
+  for (uint32_t seq = since + 1; seq <= journalseq; seq++) {
+    JournalEntry *e = &journal[seq % EVENT_JOURNAL_SIZE];
+    len += sprintf(r + len, "%u %u %s %s\n", e->seq, e->timestamp, variables[e->variable]->name, e->value);
+  }
+
+  HTTP.send(200, UPnPClass::mimeTypeText, r);
+  free(r);
 }
 
 static char *_upnp_subscribe_reply_template =
   "Server: Arduino/ESP8266 UPnP 0.1 © 2015 Danny Backx\r\n"
   "SID: %s\r\n"
+  "TIMEOUT: Second-%d\r\n"
   "ACCEPTED-STATEVAR: %s\r\n"
   "\r\n";
 
@@ -444,7 +855,6 @@ void UPnPService::EventHandler() {
     // Register the new subscriber
     UPnPSubscriber *ns = Subscribe();
   } else if (HTTP.method() == HTTP_UNSUBSCRIBE) {
-    // FIXME
     Unsubscribe();
   } else {
     // silently ignore
@@ -472,37 +882,100 @@ void UPnPService::EventHandler() {
  * CONTENT-LENGTH: 0
  * TIMEOUT: Second-actual subscription duration
  * ACCEPTED-STATEVAR: CSV of state variables
+ *
+ * A renewal has a SID instead of CALLBACK (and NT), see Renew().
  */
 UPnPSubscriber *UPnPService::Subscribe() {
-  UPnPSubscriber *ns = new UPnPSubscriber(srv);
-  Subscribe(ns);
+  if (upnp_headers[UPNP_METHOD_SID] && upnp_headers[UPNP_METHOD_CALLBACK] == NULL) {
+    Renew();
+    return NULL;
+  }
+  if (nsubscribers == MAX_SUBSCRIBERS) {
+    HTTP.send(500, UPnPClass::mimeTypeText, "Too many subscribers");
+    return NULL;
+  }
 
-  // Setup its parameters
+  UPnPSubscriber *ns = new UPnPSubscriber(this);
+
+  // Setup its parameters, the variable list must be known before it is indexed
   ns->setUrl(upnp_headers[UPNP_METHOD_CALLBACK]);
   ns->setStateVarList(upnp_headers[UPNP_METHOD_STATEVAR]);
   ns->setTimeout(upnp_headers[UPNP_METHOD_TIMEOUT]);
+  Subscribe(ns);
 
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("Subscribe URL %s\n", upnp_headers[UPNP_METHOD_CALLBACK]);
 #endif
 
-  // Provide feedback
-  char *asv = ns->getAcceptedStateVar();
-  char *sid = ns->getSID();
+  SubscribeReply(ns);
+  return ns;
+}
+
+/*
+ * SUBSCRIBE publisher path HTTP/1.1
+ * HOST: publisher host:publisher port
+ * SID: uuid:subscription UUID
+ * TIMEOUT: Second-requested subscription duration
+ *
+ * Same subscriber, same SEQ : no events lost, no new initial event.
+ */
+void UPnPService::Renew() {
+  UPnPSubscriber *sp = FindSubscriber(upnp_headers[UPNP_METHOD_SID]);
+  if (sp == NULL) {
+    HTTP.send(412, UPnPClass::mimeTypeText, "");
+    return;
+  }
+  sp->setTimeout(upnp_headers[UPNP_METHOD_TIMEOUT]);
+#ifdef UPNP_DEBUG
+  UPNP_DEBUG.printf("Renew(%s) %d s\n", sp->getSID(), sp->timeout);
+#endif
+  SubscribeReply(sp);
+}
+
+/*
+ * SID and TIMEOUT go out as headers, and also in the body as we always did.
+ */
+void UPnPService::SubscribeReply(UPnPSubscriber *sp) {
+  char *asv = sp->getAcceptedStateVar();
+  char *sid = sp->getSID();
   char *fb = (char *)malloc(strlen(_upnp_subscribe_reply_template)
-    + strlen(sid) + (asv ? strlen(asv) : 0) + 4);
-  sprintf(fb, _upnp_subscribe_reply_template, sid, asv ? asv : "");
-  // free(sid);	// Don't free SID. FIXME this is confusing.
+    + strlen(sid) + (asv ? strlen(asv) : 0) + 16);
+  sprintf(fb, _upnp_subscribe_reply_template, sid, sp->timeout, asv ? asv : "");
   if (asv) free(asv);
+
+  char timeout[20];
+  sprintf(timeout, "Second-%d", sp->timeout);
+  HTTP.sendHeader("SID", sid);
+  HTTP.sendHeader("TIMEOUT", timeout);
   HTTP.send(200, UPnPClass::mimeTypeText, fb);
+  free(fb);
+}
 
-  return ns;
+/*
+ * Drop subscriptions that weren't renewed in time. Called from UPnPClass::periodic().
+ */
+void UPnPService::ExpireSubscribers() {
+  if (nsubscribers == 0)
+    return;
+  for (int i=0; i<maxsubscribers; i++) {
+    UPnPSubscriber *s = subscriber[i];
+    if (s == NULL || ! s->expired())
+      continue;
+#ifdef UPNP_DEBUG
+    UPNP_DEBUG.printf("UPnPService(%s) : subscription %s expired\n", serviceName, s->getSID());
+#endif
+    Unsubscribe(s);
+    delete s;
+  }
 }
 
 /*
- * Add this new subscriber
+ * Add this new subscriber, and record its slot with each variable it watches.
  */
 void UPnPService::Subscribe(UPnPSubscriber *ns) {
+  if (nsubscribers == MAX_SUBSCRIBERS)
+    return;
+
   // Allocate array increments per 4 entries
   if (nsubscribers == maxsubscribers) {
     maxsubscribers += SUBSCRIBER_ALLOC_INCREMENT;
@@ -519,6 +992,14 @@ void UPnPService::Subscribe(UPnPSubscriber *ns) {
     if (subscriber[i] == NULL) {
       subscriber[i] = ns;
 
+      uint32_t vm = ns->variables;
+      while (vm) {
+        int v = __builtin_ctz(vm);
+        vm &= vm - 1;
+        variables[v]->subscribers |= (1U << i);
+      }
+      pending |= (1U << i);	// Initial event goes out from SendInitialEvents()
+
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("Subscribe -> nsubs %d (UPnPService %p)\n", nsubscribers, this);
 #endif
@@ -536,43 +1017,74 @@ void UPnPService::Unsubscribe() {
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.println("Unsubscribe");
 #endif
+  UPnPSubscriber *sp = FindSubscriber(upnp_headers[UPNP_METHOD_SID]);
+  if (sp == NULL) {
+    HTTP.send(412, UPnPClass::mimeTypeText, "");
+    return;
+  }
+  Unsubscribe(sp);
+  delete sp;
+  HTTP.send(200, UPnPClass::mimeTypeText, "");
 }
 
 void UPnPService::Unsubscribe(char *uuid) {
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("Unsubscribe(%s)\n", uuid);
 #endif
-  UPnPSubscriber *p = (UPnPSubscriber *)strtol(uuid, NULL, 16);
-  Unsubscribe(p);
+  UPnPSubscriber *p = FindSubscriber(uuid);
+  if (p) {
+    Unsubscribe(p);
+    delete p;
+  }
+}
+
+UPnPSubscriber *UPnPService::FindSubscriber(const char *sid) {
+  if (sid == NULL)
+    return NULL;
+  for (int i=0; i<maxsubscribers; i++)
+    if (subscriber[i] && strcmp(subscriber[i]->getSID(), sid) == 0)
+      return subscriber[i];
+  return NULL;
 }
 
 void UPnPService::Unsubscribe(UPnPSubscriber *sp) {
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("Unsubscribe ptr %p\n", sp);
 #endif
-  int i;
-  for (int i=0; i<nsubscribers; i++)
+  for (int i=0; i<maxsubscribers; i++)
     if (subscriber[i] == sp) {
       // We don't realloc here, just free up this spot. Fits with code in Subscribe().
       // Note this strategy does not preserve order of subscribers.
       // That can be fixed by moving the trailing subscribers down here.
       subscriber[i] = NULL;
       nsubscribers--;
+      pending &= ~(1U << i);
+
+      for (int v=0; v<nvariables; v++)
+        variables[v]->subscribers &= ~(1U << i);
 
       return;
     }
 }
 
-StateVariable *UPnPService::lookupVariable(char *name) {
+StateVariable *UPnPService::lookupVariable(const char *name) {
+  int i = lookupVariableIndex(name);
+  return (i < 0) ? NULL : variables[i];
+}
+
+// The index of a variable is also its bit position in UPnPSubscriber::variables.
+int UPnPService::lookupVariableIndex(const char *name) {
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("lookupVariable(%s)\n", name);
 #endif
+  if (name == NULL)
+    return -1;
 
   for (int i=0; i<nvariables; i++)
     if (variables[i])
       if (strcasecmp(name, variables[i]->name) == 0)
-        return variables[i];
-  return NULL;
+        return i;
+  return -1;
 }
 
 void UPnPService::SendSCPD(WiFiClient client) {
@@ -33,32 +33,28 @@
 #undef	UPNP_DEBUG
 // #define	UPNP_DEBUG Serial
 
+/*
+ * The part of a NOTIFY that is the same for every event sent to this subscriber.
+ * It is rendered once (see RenderHeader), only the SEQ and CONTENT-LENGTH
+ * values get filled in per event.
+ */
 static const char *_notify_header_template =
   "NOTIFY %s HTTP/1.0\r\n"
-  "HOST: %s:%p\r\n"
+  "HOST: %s:%d\r\n"
   "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
   "NT: upnp:event\r\n"
   "NTS: upnp:propchange\r\n"
   "SID: %s\r\n"
-  "SEQ: %d\r\n"
-  "\r\n"
+  "SEQ: "
   ;
-static const char *_notify_body_template =
-  "<?xml version=\"1.0\"?>\r\n"
-  "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\r\n"
-  "<e:property>\r\n"
-  "<variableName>%s</variableName>\r\n"
-  "</e:property>\r\n"
-  "</e:propertyset>\r\n"
+static const char *_notify_seq_template =
+  "%d\r\n"
+  "CONTENT-LENGTH: %d\r\n"
   "\r\n"
   ;
 
 char *upnp_headers[UPNP_END_METHODS];
 
-void UPnPSubscriber::SendNotify(StateVariable &sv) {
-  SendNotify(sv.name);
-}
-
 /*
  * NOTIFY delivery path HTTP/1.0
  * HOST: delivery host:delivery port
@@ -75,48 +71,126 @@ void UPnPSubscriber::SendNotify(StateVariable &sv) {
  * </e:property>
  * Other variable names and values (if any) go here.
  * </e:propertyset>
+ *
+ * The body is rendered once per event by UPnPService, and shared by all subscribers.
+ * The message goes out as one gather write : pre-rendered header, SEQ part, body.
+ * We don't wait for the reply here, Poll() picks it up. Only one NOTIFY is in
+ * progress per subscriber : check busy() first.
+ *
+ * Returns false if this subscription should be dropped.
  */
-void UPnPSubscriber::SendNotify(const char *varName) {
+bool UPnPSubscriber::SendNotify(const char *body, int bodylen) {
 #ifdef UPNP_DEBUG
-  UPNP_DEBUG.printf("SendNotify(%s, %s)\n", url, varName);
+  UPNP_DEBUG.printf("SendNotify(%s, %d)\n", url, bodylen);
 #endif
-  if (varName == NULL) {
+  if (header == NULL) {
 #ifdef UPNP_DEBUG
-  UPNP_DEBUG.println("SendNotify varName NULL");
+  UPNP_DEBUG.println("SendNotify no callback URL");
 #endif
-    return;	// FIXME Silently ignore
+    return true;	// FIXME Silently ignore
   }
-  char *body = (char *)malloc(strlen(varName) + strlen(_notify_body_template));
-  sprintf(body, _notify_body_template, varName);
 
-  char *header = (char *)malloc(strlen(_notify_header_template) + 128);
-  sprintf(header, _notify_header_template,
-    path,	// url,		// FIXME
-    host, port,		// FIXME
-    sid,			// Use the memory address of this instance as UUID, see ctor
-    seq++);
+  // Breaker open : don't waste a connect attempt until it's time to probe.
+  // No SEQ is used up, the subscriber doesn't see this as a gap.
+  if (inprogress || (isOpen() && (long)(millis() - probe) < 0)) {
+    unsent += headerlen + bodylen;
+    return true;
+  }
 
-  char *msg = (char *)malloc(strlen(body) + strlen(header) + 40);
-  sprintf(msg, "%s\r\nContent-Length: %d\r\n%s", header, strlen(body), body);
+  char seqpart[40];
+  int seqlen = sprintf(seqpart, _notify_seq_template, seq++, bodylen);
+  int total = headerlen + seqlen + bodylen;
 
-  if (wc == NULL) {
+  start = millis();
+  if (wc == NULL)
     wc = new WebClient();
-    //wc->connect(url);
-    wc->connect(host, port, path);
+
+  // One connection per event (HTTP/1.0) : only the reply tells us it arrived.
+  int len = 0;
+  if (wc->connect(host, port, path)) {
+    const char *parts[3] = { header, seqpart, body };
+    const int lens[3] = { headerlen, seqlen, bodylen };
+    len = wc->send(3, parts, lens);
   }
-  if (wc) {
-#ifdef UPNP_DEBUGx
-    UPNP_DEBUG.printf("SendNotify {%s,%s}\n", UPnPClass::mimeTypeXML, msg);
-#endif
-    wc->send(UPnPClass::mimeTypeXML, msg);
-  } else {
+  sent += len;
+  if (len != total) {
+    wc->stop();
+    unsent += total - len;
+    return Done(0);
+  }
+
+  inprogress = true;
+  deadline = start + SUBSCRIBER_REPLY_TIMEOUT;
+  linelen = 0;
+  return true;
+}
+
+/*
+ * Called from the main loop (see UPnPService::PollSubscribers) : did the NOTIFY
+ * in progress get its reply ? Returns false if this subscription should be dropped.
+ */
+bool UPnPSubscriber::Poll() {
+  if (! inprogress)
+    return true;
+
+  int status = wc->status(line, sizeof(line), linelen);
+  if (status < 0 && wc->connected() && (long)(millis() - deadline) < 0)
+    return true;	// Not yet
+
+  inprogress = false;
+  wc->stop();
+  return Done(status < 0 ? 0 : status);
+}
+
+bool UPnPSubscriber::busy() {
+  return inprogress;
+}
+
+/*
+ * A NOTIFY is done : count it, and run the circuit breaker.
+ */
+bool UPnPSubscriber::Done(int status) {
+  if (status == 200) {
+    rtt = millis() - start;
+    failures = 0;
+    backoff = 0;
+    return true;
+  }
+
+  failures++;
 #ifdef UPNP_DEBUG
-  UPNP_DEBUG.println("SendNotify WebClient NULL");
+  UPNP_DEBUG.printf("SendNotify(%s) failure %d, status %d\n", url, failures, status);
 #endif
+  if (failures >= SUBSCRIBER_DROP_FAILURES)
+    return false;
+  if (isOpen()) {
+    backoff = backoff ? backoff * 2 : SUBSCRIBER_BACKOFF_MIN;
+    if (backoff > SUBSCRIBER_BACKOFF_MAX)
+      backoff = SUBSCRIBER_BACKOFF_MAX;
+    probe = millis() + backoff;
   }
-  free(msg);
-  free(body);
-  free(header);
+  return true;
+}
+
+bool UPnPSubscriber::isOpen() {
+  return failures >= SUBSCRIBER_OPEN_FAILURES;
+}
+
+bool UPnPSubscriber::expired() {
+  return (long)(millis() - expires) >= 0;
+}
+
+/*
+ * Called when the callback URL is known, the SID never changes.
+ */
+void UPnPSubscriber::RenderHeader() {
+  if (header)
+    free(header);
+
+  const char *p = path ? path : "/";
+  int len = strlen(_notify_header_template) + strlen(p) + strlen(host) + 8 + strlen(sid);
+  header = (char *)malloc(len);
+  headerlen = sprintf(header, _notify_header_template, p, host, port, sid);
 }
 
 UPnPSubscriber::UPnPSubscriber(UPnPService *s) {
@@ -127,11 +201,22 @@ UPnPSubscriber::UPnPSubscriber(UPnPService *s) {
 
   wc = NULL;
   url = NULL;
-  seq = 1;
+  host = path = NULL;
+  port = 80;
+  header = NULL;
+  headerlen = 0;
+  inprogress = false;
+  owed = 0;
+  seq = 0;		// The initial event has SEQ 0
+  failures = 0;
+  rtt = sent = unsent = 0;
+  probe = 0;
+  backoff = 0;
   sid = (char *)malloc(16);
   sprintf(sid, "uuid:%08x", this);
-  nvariables = 0;
-  variables = NULL;
+  variables = 0;
+  timeout = SUBSCRIBER_TIMEOUT_DEFAULT;
+  expires = millis() + timeout * 1000UL;
 }
 
 UPnPSubscriber::~UPnPSubscriber() {
@@ -140,6 +225,10 @@ UPnPSubscriber::~UPnPSubscriber() {
 #endif
   if (wc)
     delete wc;
+  if (header)
+    free(header);
+  free((void *)url);
+  free((void *)host);
   free(sid);
 }
 
@@ -149,7 +238,12 @@ void UPnPSubscriber::setUrl(char *url) {
 #endif
   if (this->url)
     free((void *)this->url);
-  this->url = NULL;
+  if (this->host)
+    free((void *)this->host);
+  this->url = this->host = this->path = NULL;
+  if (header)
+    free(header);
+  header = NULL;	// No NOTIFY without a valid callback URL
   if (url == NULL)
     return;
 
@@ -170,10 +264,8 @@ void UPnPSubscriber::setUrl(char *url) {
   if (strncmp(this->url, "http://", 7) != 0)
     return;
 
-  // Look for the parts of the URL
-  host = this->url+7;
-  path = NULL;
-  const char *p, *port = NULL;
+  // Look for the parts of the URL, path points into url
+  const char *p, *port = NULL, *host = this->url+7;
 
   for (p = host; *p; p++)
     if (*p == ':' && port == NULL) {
@@ -189,8 +281,8 @@ void UPnPSubscriber::setUrl(char *url) {
     strncpy(u, host, len-1);
     u[len-1] = 0;
     this->host = u;
-  } else {	// Path points to the slash
-    len = (int)(path-host);
+  } else {	// Path points to the slash, if any
+    len = path ? (int)(path-host) : strlen(host);
     char *u = (char *)malloc(len+1);
     strncpy(u, host, len);
     u[len] = 0;
@@ -200,71 +292,43 @@ void UPnPSubscriber::setUrl(char *url) {
   this->port = 80;
   if (port)
     this->port = atoi(port);
+
+  RenderHeader();
 }
 
 /*
  * Cut a list of state variable (comma separated) into separate variable names.
- * Then try to subscribe to info on them
+ * Then try to subscribe to info on them.
+ * Without a list, the subscriber gets all evented variables (UPnP 1.0 behaviour).
  */
 void UPnPSubscriber::setStateVarList(char *stateVarList) {
-  if (stateVarList == NULL)
+  if (stateVarList == NULL) {
+    for (int i=0; i<service->nvariables; i++)
+      if (service->variables[i]->sendEvents)
+        variables |= (1U << i);
     return;
+  }
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("UPnPSubscriber::setStateVarList(%s)\n", stateVarList);
 #endif
-  char *ptr, *begin, **list;
-  bool inword = false;
-  int n = 0;
-
-  // First pass : count words
-  for (ptr = stateVarList; *ptr; ptr++) {
-#ifdef UPNP_DEBUGx
-    UPNP_DEBUG.printf("sSVL(%s) %d %s\n", ptr, n, inword ? "inword" : "out");
-#endif
-    if (inword && !isalnum(*ptr)) {
-      inword = false;
-    } else if (inword && isalnum(*ptr)) {
-      ;
-    } else if (inword == false && !isalnum(*ptr)) {
-      ;
-    } else if (inword == false && isalnum(*ptr)) {
-      n++;
-      inword = true;
-    }
-  }
+  char name[STATEVAR_NAME_LENGTH];
+  int len = 0;
 
-  // Allocate
-#ifdef UPNP_DEBUG
-  UPNP_DEBUG.printf("UPnPSubscriber::setStateVarList(%s) : %d words\n", stateVarList, n);
-#endif
-  list = (char **)malloc(sizeof(char *) * n);
-
-#define PICKUP() \
-      int len = ptr - begin; \
-      list[i] = (char *)malloc(len); \
-      strncpy(list[i], begin, len); \
-      list[i][len] = 0; \
-      setStateVar(list[i]); \
-      i++;
-
-  // Second pass : record
-  int i = 0;
-  inword = false;
-  for (ptr = stateVarList; *ptr; ptr++) {
-    if (inword && !isalnum(*ptr)) {
-      inword = false;
-      PICKUP();
-    } else if (inword && isalnum(*ptr)) {
-      ;
-    } else if (inword == false && !isalnum(*ptr)) {
-      ;
-    } else if (inword == false && isalnum(*ptr)) {
-      // n++;
-      inword = true;
-      begin = ptr;
+  // Single pass : pick up the words, anything not alphanumeric separates them.
+  for (char *ptr = stateVarList; ; ptr++) {
+    if (*ptr && isalnum(*ptr)) {
+      if (len < STATEVAR_NAME_LENGTH - 1)
+        name[len++] = *ptr;
+    } else {
+      if (len) {
+        name[len] = 0;
+        setStateVar(name);
+        len = 0;
+      }
+      if (*ptr == 0)
+        break;
     }
   }
-  PICKUP();
 }
 
 /*
@@ -273,21 +337,33 @@ void UPnPSubscriber::setStateVarList(char *stateVarList) {
  * by the feedback of one of our callers. (See UPnPService::Subscribe.)
  */
 void UPnPSubscriber::setStateVar(char *name) {
-  StateVariable *vp = service->lookupVariable(name);
-  if (! vp)
+  int ix = service->lookupVariableIndex(name);
+  if (ix < 0)
     return;	// Silently ignore
 
   // Add this to the watch list
-  int ix = nvariables++;
-  variables = (StateVariable **)realloc(variables, nvariables * sizeof(StateVariable *));
-  variables[ix] = vp;
+  variables |= (1U << ix);
 
 #ifdef UPNP_DEBUG
-  UPNP_DEBUG.printf("Subscribe : StateVar(%s) %d\n", name, nvariables);
+  UPNP_DEBUG.printf("Subscribe : StateVar(%s) %d\n", name, ix);
 #endif
 }
 
+/*
+ * TIMEOUT: Second-1800. Without one (or with Second-infinite) we grant the default.
+ * Also called when the subscription is renewed.
+ */
 void UPnPSubscriber::setTimeout(char *timeout) {
+  int t = 0;
+  if (timeout && strncasecmp(timeout, "Second-", 7) == 0 && isdigit(timeout[7]))
+    t = atoi(timeout + 7);
+  if (t <= 0)
+    t = SUBSCRIBER_TIMEOUT_DEFAULT;
+  if (t > SUBSCRIBER_TIMEOUT_MAX)
+    t = SUBSCRIBER_TIMEOUT_MAX;
+
+  this->timeout = t;
+  expires = millis() + t * 1000UL;
 }
 
 char *UPnPSubscriber::getSID() {
@@ -298,21 +374,24 @@ char *UPnPSubscriber::getSID() {
 char *UPnPSubscriber::getAcceptedStateVar() {
   // Quickly discard empty list.
   // Return NULL, not "" to be able to detect what to free in the caller.
-  if (nvariables == 0)
+  if (variables == 0)
     return NULL;
 
   // Calculate allocation size
   int len = 0;
-  for (int i=0; i<nvariables; i++)
-    len += strlen(variables[i]->name) + 1;
+  for (int i=0; i<service->nvariables; i++)
+    if (variables & (1U << i))
+      len += strlen(service->variables[i]->name) + 1;
   char *r = (char *)malloc(len);
 
   // Create the list. There's always one, see the test above.
-  strcpy(r, variables[0]->name);
-  for (int i=1; i<nvariables; i++) {
-    strcat(r, ",");
-    strcat(r, variables[i]->name);
-  }
+  r[0] = 0;
+  for (int i=0; i<service->nvariables; i++)
+    if (variables & (1U << i)) {
+      if (r[0])
+        strcat(r, ",");
+      strcat(r, service->variables[i]->name);
+    }
 #ifdef UPNP_DEBUG
   UPNP_DEBUG.printf("getAcceptedStateVar() -> %s\n", r);
 #endif
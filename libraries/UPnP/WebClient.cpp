@@ -38,8 +38,10 @@ WebClient::WebClient() {
 }
 
 WebClient::~WebClient() {
-  wc->stop();
-  delete wc;
+  if (wc) {
+    wc->stop();
+    delete wc;
+  }
 }
 
 bool WebClient::connect(const char *url) {
@@ -95,7 +97,7 @@ bool WebClient::connect(const char *host, const char *path) {
 
 bool WebClient::connect(const char *host, uint16_t port, const char *path) {
   IPAddress ip;
-  if (WiFi.hostByName(host, ip) <= 0)
+  if (! resolve(host, ip))
     return false;
 
   this->path = path;
@@ -135,6 +137,56 @@ char *WebClient::send(const char *mime, const char *msg) {
 #endif
 }
 
+/*
+ * Gather write : send a message that consists of several buffers, without
+ * concatenating them first. With Nagle enabled, lwIP coalesces them into as few
+ * segments as the buffers allow.
+ */
+size_t WebClient::send(int nparts, const char **parts, const int *lens) {
+  size_t total = 0;
+  if (wc == NULL)
+    return 0;
+  for (int i=0; i<nparts; i++)
+    if (lens[i] > 0)
+      total += wc->write(parts[i], lens[i]);
+  return total;
+}
+
+bool WebClient::connected() {
+  return wc != NULL && wc->connected();
+}
+
+/*
+ * Collect the status line of the reply in line (len bytes so far) without waiting :
+ * call again until it's complete. Returns -1 until then, and its code after
+ * (0 if it's not a valid reply).
+ */
+int WebClient::status(char *line, int size, int &len) {
+  if (wc == NULL)
+    return 0;
+
+  while (wc->available() > 0) {
+    int c = wc->read();
+    if (c < 0)
+      break;
+    if (c == '\n') {
+      line[len] = 0;
+      if (strncmp(line, "HTTP/", 5) != 0)
+        return 0;
+      char *p = strchr(line, ' ');
+      return p ? atoi(p + 1) : 0;
+    }
+    if (c != '\r' && len < size - 1)
+      line[len++] = c;
+  }
+  return -1;
+}
+
+void WebClient::stop() {
+  if (wc)
+    wc->stop();
+}
+
 char *WebClient::send(char *msg) {
 #ifdef DEBUG_OUTPUT
   DEBUG_OUTPUT.printf("WebClient::send(%f)\n", msg);
@@ -142,3 +194,62 @@ char *WebClient::send(char *msg) {
 #if 0
 #endif
 }
+
+/*
+ * Host name lookup with a small cache : controllers talk to the same few devices
+ * all the time, no need to ask the DNS server every time.
+ */
+static struct {
+  char		host[32];
+  uint32_t	ip;
+  unsigned long	expires;
+} dns_cache[WEBCLIENT_DNS_CACHE];
+static int dns_next = 0;
+
+bool WebClient::resolve(const char *host, IPAddress &ip) {
+  for (int i=0; i<WEBCLIENT_DNS_CACHE; i++)
+    if (dns_cache[i].ip && strcmp(dns_cache[i].host, host) == 0) {
+      if ((long)(millis() - dns_cache[i].expires) < 0) {
+        ip = dns_cache[i].ip;
+        return true;
+      }
+      dns_cache[i].ip = 0;
+    }
+
+  if (WiFi.hostByName(host, ip) <= 0)
+    return false;
+
+  if (strlen(host) < sizeof(dns_cache[0].host)) {
+    strcpy(dns_cache[dns_next].host, host);
+    dns_cache[dns_next].ip = ip;
+    dns_cache[dns_next].expires = millis() + WEBCLIENT_DNS_TTL;
+    dns_next = (dns_next + 1) % WEBCLIENT_DNS_CACHE;
+  }
+  return true;
+}
+
+/*
+ * Split http://host[:port][/path] without allocating memory.
+ * Path points into the url, and is "/" if absent.
+ */
+bool WebClient::parseURL(const char *url, char *host, int hostlen, uint16_t &port, const char *&path) {
+  if (strncmp(url, "http://", 7) != 0)
+    return false;
+
+  const char *p = url + 7;
+  int len = 0;
+  while (*p && *p != ':' && *p != '/') {
+    if (len == hostlen - 1)
+      return false;
+    host[len++] = *p++;
+  }
+  host[len] = 0;
+
+  port = 80;
+  if (*p == ':')
+    port = atoi(++p);
+  while (*p && *p != '/')
+    p++;
+  path = *p ? p : "/";
+  return len > 0;
+}
@@ -332,7 +332,7 @@ void WebServer::_handleRequest() {
     }
   }
 
-  const char *fn = uri().c_str();
+  const char *fn = _currentUri.c_str();
 
   if (!handler) {
     // If no specific handler was found, see if this is a file system request
@@ -355,11 +355,16 @@ void WebServer::_handleRequest() {
         _currentClient.readBytes(buffer, cl);
 	file.write(buffer, cl);
 	file.close();
+	free(buffer);
 #ifdef DEBUG_OUTPUT
       DEBUG_OUTPUT.printf("Closing file, replying\n");
 #endif
         send(200, "text/plain", String("Thanks, received : ") + _currentUri);
         handled = true;
+
+        // Let others know, e.g. to pick up a new configuration
+        if (_fileUploadHandler)
+          _fileUploadHandler();
       } else {
         send(404, "text/plain", String("Could not write file : ") + _currentUri);
         handled = true;
@@ -414,6 +419,7 @@ const char* WebServer::_responseCodeToString(int code) {
     case 200: return "OK";
     case 403: return "Forbidden";
     case 404: return "Not found";
+    case 412: return "Precondition Failed";
     case 500: return "Fail";
     default:  return "";
   }
@@ -256,6 +256,8 @@ void setup() {
   Serial.printf("Ready!\n");
   while (1) {
     HTTP.handleClient();
+    UPnP.periodic();
+    SSDP.periodic();
 #ifdef ENABLE_OTA
     ArduinoOTA.handle();
 #endif
@@ -151,7 +151,7 @@ void MotionSensorService::poll() {
 //    Serial.printf("State changed to %d (MotionSensorService %p)\n", newstate, this);
 
     // FIXME trigger something from here
-    SendNotify("State");
+    SendNotify(stateString, state);
   }
 }
 
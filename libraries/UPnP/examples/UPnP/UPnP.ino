@@ -227,6 +227,8 @@ void setup() {
   while (1) {
     ms_srv.poll();
     HTTP.handleClient();
+    UPnP.periodic();
+    SSDP.periodic();
 #ifdef ENABLE_LED_SERVICE
     led_srv.periodic();
 #endif
@@ -247,6 +249,8 @@ void setup() {
 
 void loop() {
   HTTP.handleClient();
+  UPnP.periodic();
+  SSDP.periodic();
   Serial.printf("After HandleClient : Heap %X\n", ESP.getFreeHeap());
   // Serial.printf("Called handleClient()...\n");
   delay(10);